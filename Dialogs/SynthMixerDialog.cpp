@@ -171,35 +171,23 @@ void SynthMixerDialog::resetMixLevel(InstrumentType t)
     synth->setMixLevel(t, 100);
 }
 
-void SynthMixerDialog::onPlayerPlayingEvents(MidiEvent *e)
+void SynthMixerDialog::onPlayerPlayingEvents(const MidiEventRecord &e)
 {
-    if (e->eventType() == MidiEventType::NoteOn)
+    if (e.eventType() == MidiEventType::NoteOn)
     {
         InstrumentType t;
 
-        if (e->channel() == 9) {
-            t = MidiHelper::getInstrumentDrumType(e->data1());
+        if (e.channel() == 9) {
+            t = MidiHelper::getInstrumentDrumType(e.data1());
         }
         else {
-            t = player->midiChannel()[e->channel()].instrumentType();
+            t = player->midiChannel()[e.channel()].instrumentType();
         }
 
-        chInstMap[t]->peak(e->data2());
+        chInstMap[t]->peak(e.data2());
     }
 }
 
-void SynthMixerDialog::showEvent(QShowEvent *)
-{
-    connect(player, SIGNAL(playingEvents(MidiEvent*)),
-            this, SLOT(onPlayerPlayingEvents(MidiEvent*)));
-}
-
-void SynthMixerDialog::hideEvent(QHideEvent *event)
-{
-    disconnect(player, SIGNAL(playingEvents(MidiEvent*)),
-            this, SLOT(onPlayerPlayingEvents(MidiEvent*)));
-}
-
 void SynthMixerDialog::mapChInstUI()
 {
     chInstMap[InstrumentType::Piano]                = ui->ch;
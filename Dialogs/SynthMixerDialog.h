@@ -21,6 +21,8 @@ public:
     explicit SynthMixerDialog(QWidget *parent = 0, MainWindow *mainWin = 0);//, MainWindow *mainWin = 0);
     ~SynthMixerDialog();
 
+    void onPlayerPlayingEvents(const MidiEventRecord &e);
+
 private slots:
     void setBtnEqIcon(bool s);
     void setBtnReverbIcon(bool s);
@@ -29,16 +31,11 @@ private slots:
     void setSolo(InstrumentType t, bool s);
     void setMixLevel(InstrumentType t, int level);
     void resetMixLevel(InstrumentType t);
-    void onPlayerPlayingEvents(MidiEvent *e);
 
     void on_btnSettingVu_clicked();
 
     void on_btnReset_clicked();
 
-protected:
-    void showEvent(QShowEvent *);
-    void hideEvent(QHideEvent *event);
-
 private:
     Ui::SynthMixerDialog *ui;
 
@@ -19,12 +19,18 @@ SOURCES += main.cpp\
         MainWindow.cpp \
     SettingsDialog.cpp \
     SongDatabase.cpp \
+    SongCache.cpp \
     Song.cpp \
     Midi/MidiFile.cpp \
     Midi/MidiEvent.cpp \
+    Midi/MidiEventPool.cpp \
+    Midi/MidiSeekIndex.cpp \
+    Midi/MidiNoteIndex.cpp \
+    Midi/MidiEventRing.cpp \
     Midi/MidiOut.cpp \
     Midi/Channel.cpp \
     Midi/MidiSynthesizer.cpp \
+    Midi/MidiSoundfontPool.cpp \
     Midi/MidiPlayer.cpp \
     Widgets/ChMx.cpp \
     Widgets/LyricsWidget.cpp \
@@ -51,12 +57,19 @@ SOURCES += main.cpp\
 HEADERS  += MainWindow.h \
     SettingsDialog.h \
     SongDatabase.h \
+    SongCache.h \
     Song.h \
     Midi/MidiFile.h \
     Midi/MidiEvent.h \
+    Midi/MidiEventPool.h \
+    Midi/MidiSeekIndex.h \
+    Midi/MidiNoteIndex.h \
+    Midi/MidiTempoClock.h \
+    Midi/MidiEventRing.h \
     Midi/MidiOut.h \
     Midi/Channel.h \
     Midi/MidiSynthesizer.h \
+    Midi/MidiSoundfontPool.h \
     Midi/MidiPlayer.h \
     Widgets/ChMx.h \
     Widgets/LyricsWidget.h \
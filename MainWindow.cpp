@@ -2,6 +2,7 @@
 #include "ui_MainWindow.h"
 
 #include "SettingsDialog.h"
+#include "SongCache.h"
 #include "Dialogs/AboutDialog.h"
 #include "Midi/MidiFile.h"
 
@@ -22,6 +23,7 @@ MainWindow::MainWindow(QWidget *parent) :
 
     lyrWidget = new LyricsWidget(this);
     updateDetail = new Detail(this);
+    sfLoadDetail = new Detail(this);
 
     ui->setupUi(this);
 
@@ -41,6 +43,9 @@ MainWindow::MainWindow(QWidget *parent) :
     songDetailTimer = new QTimer(this);
     songDetailTimer->setSingleShot(true);
 
+    sfLoadTimer = new QTimer(this);
+    sfLoadTimer->setInterval(200);
+
     player = new MidiPlayer();
 
     locale = QLocale(QLocale::English, QLocale::UnitedStates);
@@ -113,6 +118,14 @@ MainWindow::MainWindow(QWidget *parent) :
 
         player->setMidiOut(oPort);
         player->setVolume(vl);
+        // 0 sends each event when due, see MidiPlayer::setLookaheadMs()
+        player->setLookaheadMs(settings->value("MidiLookaheadMs", 0).toInt());
+        // Deadline spins the player thread before each event, a whole core
+        // on busy songs
+        player->setSchedulerMode(settings->value("MidiSchedulerDeadline", false).toBool()
+                                 ? MidiPlayer::Deadline : MidiPlayer::MillisecondSleep);
+        player->setClockSource(settings->value("MidiAudioClock", false).toBool()
+                               ? MidiPlayer::AudioClock : MidiPlayer::WallClock);
 
         if (lDrum) {
             int ldNum = settings->value("MidiLockDrumNumber", 0).toInt();
@@ -127,7 +140,7 @@ MainWindow::MainWindow(QWidget *parent) :
             player->setLockBass(true, lbNum);
         }
 
-        connect(player, SIGNAL(finished()), this, SLOT(onPlayerThreadFinished()));
+        connect(player, SIGNAL(playbackFinished()), this, SLOT(onPlayerPlaybackFinished()));
         connect(player, SIGNAL(bpmChanged(int)), ui->rhmWidget, SLOT(setBpm(int)));
     }
 
@@ -151,6 +164,8 @@ MainWindow::MainWindow(QWidget *parent) :
         }
         settings->endArray();
 
+        synth->setSongPresetsOnly(settings->value("SynthSongPresetsOnly", false).toBool());
+        synth->setSampleBudget(settings->value("SynthSampleBudgetMB", 0).toULongLong() * 1024 * 1024);
         synth->setSoundFonts(sfs);
         for (int i=0; i<sfvl.size(); i++) {
             synth->setSoundfontVolume(i, sfvl.at(i) / 100.0f);
@@ -306,6 +321,10 @@ MainWindow::MainWindow(QWidget *parent) :
         updateDetail->resize(250, 60);
         updateDetail->setText("กำลังปรับปรุงฐานข้อมูล");
 
+        sfLoadDetail->hide();
+        sfLoadDetail->resize(250, 60);
+        sfLoadDetail->setText("กำลังโหลดซาวด์ฟอนต์");
+
         ui->detail->hide();
         ui->frameSearch->hide();
         ui->framePlaylist->hide();
@@ -320,6 +339,8 @@ MainWindow::MainWindow(QWidget *parent) :
         connect(timer2, SIGNAL(timeout()), ui->framePlaylist, SLOT(hide()));
         connect(timer1, SIGNAL(timeout()), this, SLOT(showCurrentTime()));
         connect(positionTimer, SIGNAL(timeout()), this, SLOT(onPositiomTimerTimeOut()));
+        connect(sfLoadTimer, SIGNAL(timeout()), this, SLOT(onSfLoadTimerTimeout()));
+        showSoundfontLoading();
 
         connect(detailTimer, SIGNAL(timeout()), this, SLOT(onDetailTimerTimeout()));
         connect(songDetailTimer, SIGNAL(timeout()), ui->songDetail, SLOT(hide()));
@@ -415,6 +436,7 @@ MainWindow::~MainWindow()
 
     delete songDetailTimer;
     delete detailTimer;
+    delete sfLoadTimer;
 
     delete positionTimer;
     delete timer2;
@@ -425,6 +447,7 @@ MainWindow::~MainWindow()
     delete ui;
 
     delete updateDetail;
+    delete sfLoadDetail;
     delete lyrWidget;
 }
 
@@ -470,7 +493,7 @@ void MainWindow::play(int index)
     stop();
     if (index == -1 && playingSong.id() != "") {
         lyrWidget->reset();
-        player->start();
+        player->play();
         lyrWidget->show();
         positionTimer->start();
         player->midiSynthesizer()->setFX(player->midiSynthesizer()->getFX());
@@ -505,10 +528,17 @@ void MainWindow::play(int index)
         }
     }
 
-    player->load(p.toStdString(), true);
+    QList<long> curs;
+    if (!SongCache::load(p, curPath, player, &curs)) {
+        bool loaded = player->load(p.toStdString(), true);
+
+        QFile f(curPath);
+        curs = readCurFile(&f, player->midiFile()->resorution());
+        if (loaded)
+            SongCache::save(p, curPath, player, curs);
+    }
 
-    QFile f(curPath);
-    lyrWidget->setLyrics(playingSong.lyrics(), readCurFile(&f, player->midiFile()->resorution()));
+    lyrWidget->setLyrics(playingSong.lyrics(), curs);
     onPlayerDurationTickChanged(player->durationTick());
     onPlayerDurationMSChanged(player->durationMs());
 
@@ -521,7 +551,7 @@ void MainWindow::play(int index)
     ui->songDetail->show();
     songDetailTimer->start(5000);
 
-    player->start();
+    player->play();
     lyrWidget->show();
     positionTimer->start();
 }
@@ -535,7 +565,7 @@ void MainWindow::pause()
 
 void MainWindow::resume()
 {
-    player->start();
+    player->play();
     positionTimer->start();
 }
 
@@ -543,6 +573,7 @@ void MainWindow::stop()
 {
     positionTimer->stop();
     player->stop(true);
+    logPlaybackStats();
 
     ui->sliderPosition->setValue(0);
     lyrWidget->hide();
@@ -582,6 +613,7 @@ void MainWindow::resizeEvent(QResizeEvent *event)
     }
     lyrWidget->resize(ui->centralWidget->size());
     updateDetail->move(width() - 260, 70);
+    sfLoadDetail->move(width() - 260, 140);
     emit resized(event->size());
 }
 
@@ -975,6 +1007,17 @@ void MainWindow::onPositiomTimerTimeOut()
     ui->rhmWidget->setCurrentBeat( player->currentBeat() );
 
     onPlayerPositionMSChanged(player->positionMs());
+
+    // Events the player sent since the last frame
+    MidiEventRecord events[256];
+    int n;
+    while ((n = player->takePlayedEvents(events, 256)) > 0) {
+        for (int i=0; i<n; i++) {
+            ui->chMix->onPlayerPlayingEvent(events[i]);
+            if (synthMix->isVisible())
+                synthMix->onPlayerPlayingEvents(events[i]);
+        }
+    }
 }
 
 void MainWindow::onPlayerDurationMSChanged(qint64 d)
@@ -1053,9 +1096,10 @@ void MainWindow::onSliderVolumeValueChanged(int value)
     }
 }
 
-void MainWindow::onPlayerThreadFinished()
+void MainWindow::onPlayerPlaybackFinished()
 {
     if (player->isPlayerFinished()) {
+        logPlaybackStats();
         playNext();
     }
 }
@@ -1067,6 +1111,45 @@ void MainWindow::onDbUpdateChanged(int v)
     updateDetail->setValue(QString::number(p) + "%");
 }
 
+void MainWindow::logPlaybackStats()
+{
+    QVector<int> late = player->latenessHistogram();
+    int count = 0;
+    for (int n : late)
+        count += n;
+    if (count == 0)
+        return;
+
+    QStringList bins;
+    for (int n : late)
+        bins << QString::number(n);
+    qDebug() << "Events late by <0.1/<0.25/<0.5/<1/<2/<5/<10/>=10 ms:"
+             << bins.join("/").toUtf8().constData()
+             << "synth event calls/s:" << player->synthEventCallsPerSecond();
+}
+
+void MainWindow::showSoundfontLoading()
+{
+    if (!player->midiSynthesizer()->isLoadingSoundfonts())
+        return;
+
+    sfLoadDetail->setValue("0%");
+    sfLoadDetail->show();
+    sfLoadTimer->start();
+}
+
+void MainWindow::onSfLoadTimerTimeout()
+{
+    MidiSynthesizer *synth = player->midiSynthesizer();
+    if (!synth->isLoadingSoundfonts()) {
+        sfLoadTimer->stop();
+        sfLoadDetail->hide();
+        return;
+    }
+
+    sfLoadDetail->setValue(QString::number(synth->soundfontLoadProgress()) + "%");
+}
+
 void MainWindow::onDetailTimerTimeout()
 {
      ui->detail->hide();
@@ -52,6 +52,9 @@ public:
     ReverbDialog* reverbDialog() { return reverbDlg; }
     ChorusDialog* chorusDialog() { return chorusDlg; }
 
+    // Shows the synth soundfont loading progress until it is done
+    void showSoundfontLoading();
+
 public slots:
     void play(int index);
     void pause();
@@ -76,6 +79,7 @@ private:
     SongDatabase *db;
     QTimer *timer1, *timer2, *positionTimer;
     QTimer *songDetailTimer, *detailTimer;
+    QTimer *sfLoadTimer;
 
     QList<Song*> playlist;
     MidiPlayer *player;
@@ -85,6 +89,7 @@ private:
 
     LyricsWidget *lyrWidget;
     Detail *updateDetail;
+    Detail *sfLoadDetail;
 
     int bgType = 0;
     QString bgImg = "";
@@ -102,6 +107,9 @@ private:
     ReverbDialog *reverbDlg;
     ChorusDialog *chorusDlg;
 
+    // Logs the player's event lateness and synth call rate
+    void logPlaybackStats();
+
 
 private slots:
     void showCurrentTime();
@@ -115,6 +123,7 @@ private slots:
     void showAboutDialog();
 
     void onPositiomTimerTimeOut();
+    void onSfLoadTimerTimeout();
     void onPlayerDurationMSChanged(qint64 d);
     void onPlayerPositionMSChanged(qint64 p);
     void onPlayerDurationTickChanged(int d);
@@ -126,7 +135,7 @@ private slots:
     void on_btnPlay_clicked();
     void onSliderVolumeValueChanged(int value);
 
-    void onPlayerThreadFinished();
+    void onPlayerPlaybackFinished();
 
     void onDbUpdateChanged(int v);
     void onDetailTimerTimeout();
@@ -7,74 +7,70 @@
 MidiEvent::MidiEvent() {
     eTick = 0;
     eDelta = 0;
+    eValue = 0;
     eTrack = 0;
-    eChannel = -1;
-    eData1 = 0;
-    eData2 = 0;
-    eType = MidiEventType::None;
-    mType = MidiMetaType::Invalid;
+    eStatus = 0;
+    mType = static_cast<uint8_t>(MidiMetaType::Invalid);
 }
 
-MidiEvent::~MidiEvent() {
-    mData.clear();
+void MidiEvent::setEventType(MidiEventType et) {
+    switch (et) {
+        case MidiEventType::Meta:
+        case MidiEventType::SysEx:
+            eStatus = static_cast<uint8_t>(et);
+            break;
+        case MidiEventType::None:
+            eStatus = eStatus & 0x0F;
+            break;
+        default:
+            eStatus = static_cast<uint8_t>(et) | (eStatus & 0x0F);
+            break;
+    }
 }
 
-MidiEvent &MidiEvent::operator =(const MidiEvent &e)
-{
-    mData.clear();
+int MidiEvent::channel() const {
+    if (eStatus >= 0x80 && eStatus < 0xF0)
+        return eStatus & 0x0F;
+    else
+        return -1;
+}
 
-    eTick       = e.tick();
-    eDelta      = e.delta();
-    eTrack      = e.track();
-    eChannel    = e.channel();
-    eData1      = e.data1();
-    eData2      = e.data2();
-    eType       = e.eventType();
-    mType       = e.metaEventType();
-    mData       = e.data();
+MidiEventType MidiEvent::eventType() const {
+    if (eStatus < 0x80)
+        return MidiEventType::None;
+    if (eStatus < 0xF0)
+        return static_cast<MidiEventType>(eStatus & 0xF0);
+    if (eStatus == 0xFF)
+        return MidiEventType::Meta;
 
-    return *this;
+    return MidiEventType::SysEx;
 }
 
 void MidiEvent::setMetaType(int mNumber) {
     switch (mNumber) {
-        case 0:   mType = MidiMetaType::SequenceNumber; break;
-        case 1:   mType = MidiMetaType::TextEvent; break;
-        case 2:   mType = MidiMetaType::CopyrightNotice; break;
-        case 3:   mType = MidiMetaType::SequenceTrackName; break;
-        case 4:   mType = MidiMetaType::InstrumentName; break;
-        case 5:   mType = MidiMetaType::Lyrics; break;
-        case 6:   mType = MidiMetaType::Marker; break;
-        case 7:   mType = MidiMetaType::CuePoint; break;
-        case 32:  mType = MidiMetaType::MIDIChannelPrefix; break;
-        case 47:  mType = MidiMetaType::EndOfTrack; break;
-        case 81:  mType = MidiMetaType::SetTempo; break;
-        case 84:  mType = MidiMetaType::SMPTEOffset; break;
-        case 88:  mType = MidiMetaType::TimeSignature; break;
-        case 89:  mType = MidiMetaType::KeySignature; break;
-        case 127: mType = MidiMetaType::SequencerSpecific; break;
-        default:  mType = MidiMetaType::Invalid; break;
+        case 0:   setMetaType(MidiMetaType::SequenceNumber); break;
+        case 1:   setMetaType(MidiMetaType::TextEvent); break;
+        case 2:   setMetaType(MidiMetaType::CopyrightNotice); break;
+        case 3:   setMetaType(MidiMetaType::SequenceTrackName); break;
+        case 4:   setMetaType(MidiMetaType::InstrumentName); break;
+        case 5:   setMetaType(MidiMetaType::Lyrics); break;
+        case 6:   setMetaType(MidiMetaType::Marker); break;
+        case 7:   setMetaType(MidiMetaType::CuePoint); break;
+        case 32:  setMetaType(MidiMetaType::MIDIChannelPrefix); break;
+        case 47:  setMetaType(MidiMetaType::EndOfTrack); break;
+        case 81:  setMetaType(MidiMetaType::SetTempo); break;
+        case 84:  setMetaType(MidiMetaType::SMPTEOffset); break;
+        case 88:  setMetaType(MidiMetaType::TimeSignature); break;
+        case 89:  setMetaType(MidiMetaType::KeySignature); break;
+        case 127: setMetaType(MidiMetaType::SequencerSpecific); break;
+        default:  setMetaType(MidiMetaType::Invalid); break;
     }
 }
 
-int32_t MidiEvent::message() {
-    if ((eType != MidiEventType::None)
-            && (eType != MidiEventType::Meta) &&
-            (eType != MidiEventType::SysEx) ) {
-        return static_cast<int32_t>(eType) + eChannel | eData1 << 8 | eData2 << 16;
+int32_t MidiEvent::message() const {
+    if (eStatus >= 0x80 && eStatus < 0xF0) {
+        return eStatus | data1() << 8 | data2() << 16;
     } else {
         return 0;
     }
 }
-
-float MidiEvent::tempoBpm()
-{
-    int32_t midi_tempo = 0;
-
-    if ((eType != MidiEventType::Meta) || (mType != MidiMetaType::SetTempo)) {
-            return 0;
-    }
-
-    midi_tempo = (mData[0] << 16) | (mData[1] << 8) | mData[2];
-    return (float)(60000000.0 / midi_tempo);
-}
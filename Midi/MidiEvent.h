@@ -6,7 +6,6 @@
 #define MIDI_MIDIEVENT_H
 
 #include <cstdint>
-#include <vector>
 
 enum class MidiEventType {
     NoteOff = 0x80,
@@ -41,47 +40,51 @@ enum class MidiMetaType {
 };
 
 
+/*
+    Packed 16 bytes event record.
+
+        Channel events keep data1 in the low and data2 in the high 16 bits
+        of eValue. Meta and SysEx events keep the index of their payload in
+        the MidiFile payload table there instead, see MidiFile::data().
+*/
+
 class MidiEvent {
 public:
     MidiEvent();
-    ~MidiEvent();
-    MidiEvent &operator = (const MidiEvent &e);
 
     void setTick(uint32_t t)        { eTick = t; }
     void setDelta(uint32_t d)       { eDelta = d; }
     void setTrack(int t)            { eTrack = t; }
-    void setChannel(int ch)         { eChannel = ch; }
-    void setData1(int d1)           { eData1 = d1; }
-    void setData2(int d2)           { eData2 = d2; }
-    void setEventType(MidiEventType et) { eType = et; }
-    void setData(std::vector<unsigned char> md) { mData = md; }
-    void setMetaType(MidiMetaType t)  { mType = t; }
+    void setChannel(int ch)         { eStatus = (eStatus & 0xF0) | (ch & 0x0F); }
+    void setData1(int d1)           { eValue = (eValue & 0xFFFF0000) | (d1 & 0xFFFF); }
+    void setData2(int d2)           { eValue = (eValue & 0x0000FFFF) | ((uint32_t)(d2 & 0xFFFF) << 16); }
+    void setEventType(MidiEventType et);
+    void setPayloadIndex(uint32_t i){ eValue = i; }
+    void setMetaType(MidiMetaType t)  { mType = static_cast<uint8_t>(t); }
     void setMetaType(int mNumber);
 
-    int32_t         message();
+    int32_t         message() const;
     uint32_t        tick() const           { return eTick; }
     uint32_t        delta() const          { return eDelta; }
     int             track() const          { return eTrack; }
-    int             channel() const        { return eChannel; }
-    int             data1() const          { return eData1; }
-    int             data2() const          { return eData2; }
-    MidiEventType   eventType() const      { return eType; }
-    MidiMetaType    metaEventType() const  { return mType; }
-    std::vector<unsigned char> data() const{ return mData; }
-
-    float tempoBpm();
+    int             channel() const;
+    int             data1() const          { return eValue & 0xFFFF; }
+    int             data2() const          { return eValue >> 16; }
+    uint32_t        payloadIndex() const   { return eValue; }
+    uint8_t         status() const         { return eStatus; }
+    MidiEventType   eventType() const;
+    MidiMetaType    metaEventType() const  { return static_cast<MidiMetaType>(mType); }
 
 private:
     uint32_t eTick;
     uint32_t eDelta;
-    int eTrack;
-    int eChannel;
-    int eData1;
-    int eData2;
-    MidiEventType eType;
-    MidiMetaType mType;
-    std::vector<unsigned char> mData; // Meta, SysEx
+    uint32_t eValue;
+    uint16_t eTrack;
+    uint8_t  eStatus;   // 0x80 - 0xEF channel events, 0xF7 SysEx, 0xFF Meta
+    uint8_t  mType;
 };
 
+static_assert(sizeof(MidiEvent) == 16, "MidiEvent must stay 16 bytes");
+
 
 #endif //MIDI_MIDIEVENT_H
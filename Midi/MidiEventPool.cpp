@@ -0,0 +1,21 @@
+#include "MidiEventPool.h"
+
+MidiEventPool::~MidiEventPool()
+{
+    clear();
+}
+
+MidiEvent* MidiEventPool::adopt(std::vector<MidiEvent> &block)
+{
+    blocks.push_back(std::vector<MidiEvent>());
+    blocks.back().swap(block);
+    poolSize += blocks.back().size();
+
+    return blocks.back().data();
+}
+
+void MidiEventPool::clear()
+{
+    blocks.clear();
+    poolSize = 0;
+}
@@ -0,0 +1,37 @@
+#ifndef MIDIEVENTPOOL_H
+#define MIDIEVENTPOOL_H
+
+#include "MidiEvent.h"
+
+#include <cstddef>
+#include <vector>
+
+/*
+    Owns every MidiEvent of one song in a few contiguous blocks.
+
+        Blocks are taken over whole and never grow, so pointers into them
+        stay valid until clear() is called.
+*/
+
+class MidiEventPool
+{
+public:
+    MidiEventPool() {}
+    ~MidiEventPool();
+
+    size_t size() { return poolSize; }
+    size_t blockCount() { return blocks.size(); }
+
+    // Takes over an already filled block, returns its first event
+    MidiEvent* adopt(std::vector<MidiEvent> &block);
+    void clear();
+
+private:
+    std::vector<std::vector<MidiEvent>> blocks;
+    size_t poolSize = 0;
+
+    MidiEventPool(const MidiEventPool &);
+    MidiEventPool &operator = (const MidiEventPool &);
+};
+
+#endif // MIDIEVENTPOOL_H
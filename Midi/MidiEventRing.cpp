@@ -0,0 +1,38 @@
+#include "MidiEventRing.h"
+
+MidiEventRing::MidiEventRing(size_t capacity) : head(0), fDropped(0), tail(0)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    buffer.resize(size);
+    mask = size - 1;
+}
+
+bool MidiEventRing::push(const MidiEventRecord &r)
+{
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == buffer.size()) {
+        fDropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    buffer[h & mask] = r;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+}
+
+size_t MidiEventRing::pop(MidiEventRecord *out, size_t max)
+{
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t n = head.load(std::memory_order_acquire) - t;
+    if (n > max)
+        n = max;
+
+    for (size_t i=0; i<n; i++)
+        out[i] = buffer[(t + i) & mask];
+
+    tail.store(t + n, std::memory_order_release);
+    return n;
+}
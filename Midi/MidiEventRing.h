@@ -0,0 +1,67 @@
+#ifndef MIDIEVENTRING_H
+#define MIDIEVENTRING_H
+
+#include "MidiEvent.h"
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Channel event as the UI sees it, copied out of the song so it stays
+// valid however late it is read
+struct MidiEventRecord {
+    uint8_t status;     // Event type | channel
+    uint8_t value1;
+    uint8_t value2;
+    uint8_t reserved;
+
+    static MidiEventRecord fromEvent(const MidiEvent *e) {
+        MidiEventRecord r = { e->status(), (uint8_t)e->data1(), (uint8_t)e->data2(), 0 };
+        return r;
+    }
+
+    MidiEventType eventType() const { return static_cast<MidiEventType>(status & 0xF0); }
+    int channel() const { return status & 0x0F; }
+    int data1() const   { return value1; }
+    int data2() const   { return value2; }
+};
+
+/*
+    Wait-free single producer, single consumer ring of event records.
+
+        push() is only called by the producer thread and pop() only by the
+        consumer thread. A full ring drops the new record rather than
+        making the producer wait, dropped() counts them.
+*/
+
+class MidiEventRing
+{
+public:
+    // Capacity is rounded up to a power of 2
+    explicit MidiEventRing(size_t capacity = 4096);
+
+    bool push(const MidiEventRecord &r);
+    size_t pop(MidiEventRecord *out, size_t max);
+
+    size_t capacity() { return buffer.size(); }
+    uint64_t dropped() { return fDropped.load(std::memory_order_relaxed); }
+
+private:
+    std::vector<MidiEventRecord> buffer;
+    size_t mask;
+
+    // Each side's counters on their own cache line. Padded rather than
+    // alignas(64), the ring lives inside heap objects and C++11 new does
+    // not honour over-alignment.
+    char pad0[64];
+    std::atomic<size_t> head;       // Next slot to write
+    std::atomic<uint64_t> fDropped; // Also written by the producer
+    char pad1[64];
+    std::atomic<size_t> tail;       // Next slot to read
+    char pad2[64 - sizeof(std::atomic<size_t>)];
+
+    MidiEventRing(const MidiEventRing &);
+    MidiEventRing &operator = (const MidiEventRing &);
+};
+
+#endif // MIDIEVENTRING_H
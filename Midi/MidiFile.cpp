@@ -8,8 +8,11 @@
 #include <fstream>
 #include <cstring>
 #include <algorithm>
+#include <atomic>
+#include <thread>
 
 MidiFile::MidiFile() {
+    fReadThreads = 1;
     clear();
 }
 
@@ -21,25 +24,24 @@ int MidiFile::bpm()
 {
     int bpm = 120;
     if (fTempoEvents.size() > 0) {
-        bpm = fTempoEvents[0]->tempoBpm();
+        bpm = tempoBpm(fTempoEvents[0]);
     }
 
     return bpm;
 }
 
 
-bool eventTickCompare(MidiEvent *e1, MidiEvent *e2) {
+bool eventTickCompare(const MidiEvent *e1, const MidiEvent *e2) {
     return e1->tick() < e2->tick();
 }
 
 
-std::vector<MidiEvent *> MidiFile::controllerAndProgramEvents()
+std::vector<const MidiEvent *> MidiFile::controllerAndProgramEvents()
 {
-    std::vector<MidiEvent*> evnts = fControllerEvents;
-    for (MidiEvent *e : fProgramChangeEvents)
-        evnts.push_back(e);
-
-    std::sort(evnts.begin(), evnts.end(), eventTickCompare);
+    std::vector<const MidiEvent*> evnts(fControllerEvents.size() + fProgramChangeEvents.size());
+    std::merge(fControllerEvents.begin(), fControllerEvents.end(),
+               fProgramChangeEvents.begin(), fProgramChangeEvents.end(),
+               evnts.begin(), eventTickCompare);
     return evnts;
 }
 
@@ -48,271 +50,625 @@ void MidiFile::clear() {
     fNumOfTracks = 0;
     fResolution = 0;
     fDivision = PPQ;
-    for (MidiEvent *e : fEvents)
-        delete e;
     fEvents.clear();
     fTempoEvents.clear();
     fControllerEvents.clear();
     fProgramChangeEvents.clear();
     fTimeSignatureEvents.clear();
+    fPayloads.clear();
+    fPayloadData.clear();
+    fEventPool.clear();
+    fEventTimes.clear();
+    buildTempoMap();
+}
+
+// Cursor over the in-memory copy of a file. Every read is bounds-checked,
+// running past the end clears "ok" and returns zeros instead.
+struct ByteCursor {
+    const unsigned char *pos;
+    const unsigned char *end;
+    bool ok;
+};
+
+bool readFileToBuffer(const std::string &filename, std::vector<unsigned char> *buffer) {
+    std::ifstream in(filename, std::ios::in|std::ios::binary|std::ios::ate);
+    if (!in.is_open())
+        return false;
+
+    std::streamoff size = in.tellg();
+    if (size <= 0)
+        return false;
+
+    buffer->resize(size);
+    in.seekg(0, std::ios::beg);
+    in.read((char*)buffer->data(), size);
+
+    return (bool)in;
+}
+
+uint32_t remaining(ByteCursor *c) {
+    return c->end - c->pos;
 }
 
-bool fileExists(const std::string& filename) {
-    std::ifstream ifile(filename.c_str());
-    return (bool)ifile;
+unsigned char readByte(ByteCursor *c) {
+    if (c->pos >= c->end) {
+        c->ok = false;
+        return 0;
+    }
+    return *c->pos++;
 }
 
-uint16_t readUInt16(std::ifstream *in) {
-    unsigned char buffer[2];
-    in->read((char*)buffer, 2);
-    return ((uint16_t)(buffer[0]) << 8) | (uint16_t)(buffer[1]);
+uint16_t readUInt16(ByteCursor *c) {
+    if (remaining(c) < 2) {
+        c->ok = false;
+        c->pos = c->end;
+        return 0;
+    }
+    const unsigned char *b = c->pos;
+    c->pos += 2;
+    return ((uint16_t)(b[0]) << 8) | (uint16_t)(b[1]);
 }
 
-uint32_t readUInt32(std::ifstream *in) {
-    unsigned char buffer[4];
-    in->read((char*)&buffer, 4);
-    return ((uint32_t)(buffer[0]) << 24) | ((uint32_t)(buffer[1]) << 16) |
-           ((uint32_t)(buffer[2]) << 8) | (uint32_t)(buffer[3]);
+uint32_t readUInt32(ByteCursor *c) {
+    if (remaining(c) < 4) {
+        c->ok = false;
+        c->pos = c->end;
+        return 0;
+    }
+    const unsigned char *b = c->pos;
+    c->pos += 4;
+    return ((uint32_t)(b[0]) << 24) | ((uint32_t)(b[1]) << 16) |
+           ((uint32_t)(b[2]) << 8) | (uint32_t)(b[3]);
 }
 
-uint32_t readVariableLengthQuantity(std::ifstream *in) {
+uint32_t readVariableLengthQuantity(ByteCursor *c) {
     unsigned char b;
     uint32_t value = 0;
+    int n = 0;
     do {
-        b = in->get();
+        b = readByte(c);
         value = (value << 7) | (b & 0x7F);
-    } while ((b & 0x80) == 0x80 && !in->eof());
+        n++;
+    } while ((b & 0x80) == 0x80 && c->ok && n < 4);
 
     return value;
 }
 
-bool MidiFile::read(const std::string &filename, bool seekFileChunkID) {
+// Events of one MTrk chunk in file order, with their payloads indexed
+// locally until mergeTracks() moves them into the song tables.
+struct MidiTrackBuffer {
+    std::vector<MidiEvent> events;
+    std::vector<MidiPayload> payloads;
+    std::vector<unsigned char> payloadData;
+};
+
+uint32_t addPayload(MidiTrackBuffer *tb, const unsigned char *head, uint32_t headSize, const unsigned char *data, uint32_t size) {
+    MidiPayload p;
+    p.offset = tb->payloadData.size();
+    p.size = headSize + size;
+    p.value = 0;
+
+    tb->payloadData.insert(tb->payloadData.end(), head, head + headSize);
+    tb->payloadData.insert(tb->payloadData.end(), data, data + size);
+    tb->payloads.push_back(p);
+
+    return tb->payloads.size() - 1;
+}
 
-    if (!fileExists(filename))
-        return false;
+void addMidiEvent(MidiTrackBuffer *tb, int track, uint32_t tick, uint32_t delta, MidiEventType evType, int ch, int data1, int data2) {
+    tb->events.push_back(MidiEvent());
+    MidiEvent &e = tb->events.back();
+    e.setTrack(track);
+    e.setTick(tick);
+    e.setDelta(delta);
+    e.setEventType(evType);
+    e.setChannel(ch);
+    e.setData1(data1);
+    e.setData2(data2);
+}
 
-    std::ifstream in(filename, std::ios::in|std::ios::binary);
-    if (!in.is_open())
-        return false;
+void addMetaEvent(MidiTrackBuffer *tb, int track, uint32_t tick, uint32_t delta, int number, const unsigned char *data, uint32_t size) {
+    tb->events.push_back(MidiEvent());
+    MidiEvent &me = tb->events.back();
+    me.setTrack(track);
+    me.setTick(tick);
+    me.setDelta(delta);
+    me.setEventType(MidiEventType::Meta);
+    me.setMetaType(number);
+    me.setPayloadIndex(addPayload(tb, nullptr, 0, data, size));
+
+    MidiPayload &p = tb->payloads.back();
+    if (me.metaEventType() == MidiMetaType::SetTempo && size >= 3)
+        p.value = (data[0] << 16) | (data[1] << 8) | data[2];
+    if (me.metaEventType() == MidiMetaType::TimeSignature && size >= 2)
+        p.value = data[0] | (data[1] << 8);
+}
 
-    clear();
+void addSysExEvent(MidiTrackBuffer *tb, int track, uint32_t tick, uint32_t delta, unsigned char status, const unsigned char *data, uint32_t size) {
+    tb->events.push_back(MidiEvent());
+    MidiEvent &e = tb->events.back();
+    e.setTrack(track);
+    e.setTick(tick);
+    e.setDelta(delta);
+    e.setEventType(MidiEventType::SysEx);
+    e.setPayloadIndex(addPayload(tb, &status, 1, data, size));
+}
+
+void decodeTrack(int t, ByteCursor trk, MidiTrackBuffer *tb) {
+    // A channel event takes at least 3 bytes with running status
+    tb->events.reserve(remaining(&trk) / 3);
+
+    uint32_t tick = 0, delta = 0;
+    unsigned char status, runningStatus = 0;
+
+    while (trk.pos < trk.end && trk.ok) {
+        delta = readVariableLengthQuantity(&trk);
+        tick += delta;
+
+        if (trk.pos >= trk.end)
+            break;
 
-    char chunkID[4];
-    uint32_t chunkSize = 0, chunkStart = 0;
+        if ((*trk.pos & 0x80) == 0) {
+            status = runningStatus;
+        } else {
+            status = *trk.pos++;
+            runningStatus = status;
+        }
+
+        switch (status & 0xF0) {
+            case 0x80: {
+                int ch = status & 0x0F;
+                char d1 = readByte(&trk);
+                char d2 = readByte(&trk);
+                addMidiEvent(tb, t, tick, delta, MidiEventType::NoteOff, ch, d1, d2);
+                break;
+            }
+            case 0x90: {
+                int ch = status & 0x0F;
+                char d1 = readByte(&trk);
+                char d2 = readByte(&trk);
+                if (d2 != 0) {
+                    addMidiEvent(tb, t, tick, delta, MidiEventType::NoteOn, ch, d1, d2);
+                } else {
+                    addMidiEvent(tb, t, tick, delta, MidiEventType::NoteOff, ch, d1, 0);
+                }
+                break;
+            }
+            case 0xA0: {
+                int ch = status & 0x0F;
+                char d1 = readByte(&trk);
+                char d2 = readByte(&trk);
+                addMidiEvent(tb, t, tick, delta, MidiEventType::NoteAftertouch, ch, d1, d2);
+                break;
+            }
+            case 0xB0: {
+                int ch = status & 0x0F;
+                char d1 = readByte(&trk);
+                char d2 = readByte(&trk);
+                addMidiEvent(tb, t, tick, delta, MidiEventType::Controller, ch, d1, d2);
+                break;
+            }
+            case 0xC0: {
+                int ch = status & 0x0F;
+                char d1 = readByte(&trk);
+                addMidiEvent(tb, t, tick, delta, MidiEventType::ProgramChange, ch, d1, 0);
+                break;
+            }
+            case 0xD0: {
+                int ch = status & 0x0F;
+                char d1 = readByte(&trk);
+                addMidiEvent(tb, t, tick, delta, MidiEventType::ChannelAftertouch, ch, d1, 0);
+                break;
+            }
+            case 0xE0: {
+                int ch = status & 0x0F;
+                char d1 = readByte(&trk);
+                char d2 = readByte(&trk);
+                int pitch = ((d2 & 0x7F) << 7) | (d1 & 0x7F);
+                addMidiEvent(tb, t, tick, delta, MidiEventType::PitchBend, ch, pitch, 0);
+                break;
+            }
+            case 0xF0:
+                uint32_t lenght = 0;
+                switch (status) {
+                    case 0xF0:
+                    case 0xF7:
+                        // Read before clamping, remaining() depends on it
+                        lenght = readVariableLengthQuantity(&trk);
+                        lenght = std::min(lenght, remaining(&trk));
+                        addSysExEvent(tb, t, tick, delta, status, trk.pos, lenght);
+                        trk.pos += lenght;
+                        break;
+                    case 0xFF:
+                        char number = readByte(&trk);
+                        lenght = readVariableLengthQuantity(&trk);
+                        lenght = std::min(lenght, remaining(&trk));
+                        addMetaEvent(tb, t, tick, delta, number, trk.pos, lenght);
+                        trk.pos += lenght;
+                        break;
+                }
+                break;
+        }
+    }
+}
+
+// Parses the MThd chunk into the header fields of info and collects the
+// range of every MTrk chunk.
+bool readChunks(const std::vector<unsigned char> &buffer, bool seekFileChunkID,
+                MidiFileInfo *info, std::vector<ByteCursor> *chunks) {
+    ByteCursor in = { buffer.data(), buffer.data() + buffer.size(), true };
+
+    if (remaining(&in) < 14) {
+        std::cout << "File is too small. " << buffer.size() << std::endl;
+        return false;
+    }
 
-    in.read((char*)chunkID, 4);
+    const unsigned char *chunkID = in.pos;
+    in.pos += 4;
 
     if (seekFileChunkID == false) {
         if (memcmp(chunkID, "MThd", 4) != 0) {
-            std::cout << "File chunk ID is invalid. " << chunkID << std::endl;
+            std::cout << "File chunk ID is invalid. " << std::string((const char*)chunkID, 4) << std::endl;
             return false;
         }
     }
 
-    chunkSize = readUInt32(&in);
-    chunkStart = in.tellg();
+    uint32_t chunkSize = readUInt32(&in);
 
     if (chunkSize != 6) {
         std::cout << "Chunk size is invalid. " << chunkSize << std::endl;
         return false;
     }
 
-    fFormatType = readUInt16(&in);
-    fNumOfTracks = readUInt16(&in);
+    info->formatType = readUInt16(&in);
+    info->numberOfTracks = readUInt16(&in);
 
     unsigned char divResolution[2];
-    in.read((char*)divResolution, 2);
+    divResolution[0] = readByte(&in);
+    divResolution[1] = readByte(&in);
 
     switch ((signed char)(divResolution[0])) {
-        case SMPTE24:
-            fDivision = SMPTE24;
-            fResolution = divResolution[1];
+        case MidiFile::SMPTE24:
+            info->division = MidiFile::SMPTE24;
+            info->resolution = divResolution[1];
             break;
-        case SMPTE25:
-            fDivision = SMPTE25;
-            fResolution = divResolution[1];
+        case MidiFile::SMPTE25:
+            info->division = MidiFile::SMPTE25;
+            info->resolution = divResolution[1];
             break;
-        case SMPTE30DROP:
-            fDivision = SMPTE30DROP;
-            fResolution = divResolution[1];
+        case MidiFile::SMPTE30DROP:
+            info->division = MidiFile::SMPTE30DROP;
+            info->resolution = divResolution[1];
             break;
-        case SMPTE30:
-            fDivision = SMPTE30;
-            fResolution = divResolution[1];
+        case MidiFile::SMPTE30:
+            info->division = MidiFile::SMPTE30;
+            info->resolution = divResolution[1];
             break;
         default:
-            fDivision = PPQ;
-            fResolution = divResolution[1] | divResolution[0] << 8;
+            info->division = MidiFile::PPQ;
+            info->resolution = divResolution[1] | divResolution[0] << 8;
             break;
     }
 
-    for (int t=0; t<fNumOfTracks; t++) {
+    chunks->resize(info->numberOfTracks);
+
+    for (int t=0; t<info->numberOfTracks; t++) {
+
+        if (remaining(&in) < 8) {
+            std::cout << "Track " << t << " chunk is truncated." << std::endl;
+            return false;
+        }
 
-        in.read((char*)chunkID, 4);
+        chunkID = in.pos;
+        in.pos += 4;
         chunkSize = readUInt32(&in);
-        chunkStart = in.tellg();
 
         if (memcmp(chunkID, "MTrk", 4) != 0) {
-            clear();
-            std::cout << "Track " << t << " chunk ID is invalid. " << chunkID << std::endl;;
+            std::cout << "Track " << t << " chunk ID is invalid. " << std::string((const char*)chunkID, 4) << std::endl;
             return false;
         }
 
-        uint32_t tick = 0, delta = 0;
-        unsigned char status, runningStatus = 0;
-        bool endOfTrack = false;
-
-        while ((in.tellg() < (chunkStart + chunkSize)) && !in.eof()) {
-            delta = readVariableLengthQuantity(&in);
-            tick += delta;
-            status = in.get();
-
-            if ((status & 0x80) == 0) {
-                status = runningStatus;
-                std::fstream::pos_type p = 1;
-                in.seekg(in.tellg() - p);
-            } else {
-                runningStatus = status;
-            }
+        // Clamp the track to the data actually present, a few NCN files
+        // declare a longer chunk than the file holds.
+        ByteCursor trk = { in.pos, in.pos + std::min(chunkSize, remaining(&in)), true };
+        in.pos = trk.end;
+        (*chunks)[t] = trk;
+    }
 
-            switch (status & 0xF0) {
-                case 0x80: {
-                    int ch = status & 0x0F;
-                    char d1 = in.get();
-                    char d2 = in.get();
-                    createMidiEvent(t, tick, delta, MidiEventType::NoteOff, ch, d1, d2);
-                    break;
-                }
-                case 0x90: {
-                    int ch = status & 0x0F;
-                    char d1 = in.get();
-                    char d2 = in.get();
-                    if (d2 != 0) {
-                        createMidiEvent(t, tick, delta, MidiEventType::NoteOn, ch, d1, d2);
-                    } else {
-                        createMidiEvent(t, tick, delta, MidiEventType::NoteOff, ch, d1, 0);
-                    }
-                    break;
-                }
-                case 0xA0: {
-                    int ch = status & 0x0F;
-                    char d1 = in.get();
-                    char d2 = in.get();
-                    createMidiEvent(t, tick, delta, MidiEventType::NoteAftertouch, ch, d1, d2);
-                    break;
-                }
-                case 0xB0: {
-                    int ch = status & 0x0F;
-                    char d1 = in.get();
-                    char d2 = in.get();
-                    MidiEvent *e = createMidiEvent(t, tick, delta, MidiEventType::Controller, ch, d1, d2);
-                    fControllerEvents.push_back(e);
-                    break;
-                }
-                case 0xC0: {
-                    int ch = status & 0x0F;
-                    char d1 = in.get();
-                    MidiEvent *e = createMidiEvent(t, tick, delta, MidiEventType::ProgramChange, ch, d1, 0);
-                    fProgramChangeEvents.push_back(e);
-                    break;
-                }
-                case 0xD0: {
-                    int ch = status & 0x0F;
-                    char d1 = in.get();
-                    createMidiEvent(t, tick, delta, MidiEventType::ChannelAftertouch, ch, d1, 0);
-                    break;
-                }
-                case 0xE0: {
-                    int ch = status & 0x0F;
-                    char d1 = in.get();
-                    char d2 = in.get();
-                    int pitch = ((d2 & 0x7F) << 7) | (d1 & 0x7F);
-                    createMidiEvent(t, tick, delta, MidiEventType::PitchBend, ch, pitch, 0);
-                    break;
-                }
-                case 0xF0:
-                    std::vector<unsigned char> data;
-                    int lenght = 0;
-                    switch (status) {
-                        case 0xF0:
-                        case 0xF7:
-                            lenght = readVariableLengthQuantity(&in) + 1;
-                            data.push_back(status);
-                            for (int i=0; i<lenght -1; i++) {
-                                data.push_back(in.get());
-                            }
-                            createSysExEvent(t, tick, delta, data);
-                            break;
-                        case 0xFF:
-                            char number = in.get();
-                            lenght = readVariableLengthQuantity(&in);
-                            for (int i=0; i<lenght; i++) {
-                                data.push_back(in.get());
+    return true;
+}
+
+// Walks a track like decodeTrack() but only keeps what readInfo() reports.
+// Returns the tick of the last event.
+uint32_t scanTrack(int t, ByteCursor trk, MidiFileInfo *info) {
+    uint32_t tick = 0;
+    unsigned char status, runningStatus = 0;
+    bool tempoFound = false, timeSignatureFound = false;
+
+    while (trk.pos < trk.end && trk.ok) {
+        tick += readVariableLengthQuantity(&trk);
+
+        if (trk.pos >= trk.end)
+            break;
+
+        if ((*trk.pos & 0x80) == 0) {
+            status = runningStatus;
+        } else {
+            status = *trk.pos++;
+            runningStatus = status;
+        }
+
+        uint32_t lenght = 0;
+        switch (status & 0xF0) {
+            case 0xC0:
+            case 0xD0:
+                lenght = 1;
+                break;
+            case 0xF0:
+                if (status == 0xFF) {
+                    int number = readByte(&trk);
+                    // Clamped before the data below is looked at, see decodeTrack()
+                    lenght = readVariableLengthQuantity(&trk);
+                    lenght = std::min(lenght, remaining(&trk));
+
+                    if (number == (int)MidiMetaType::SetTempo && lenght >= 3 && !tempoFound) {
+                        uint32_t tempo = (trk.pos[0] << 16) | (trk.pos[1] << 8) | trk.pos[2];
+                        if (tempo > 0) {
+                            tempoFound = true;
+                            if (info->tempo == 0 || tick < info->tempoTick) {
+                                info->tempo = tempo;
+                                info->tempoTick = tick;
                             }
-                            createMetaEvent(t, tick, delta, number, data);
-                            break;
+                        }
                     }
-                    break;
-            }
+                    if (number == (int)MidiMetaType::TimeSignature && lenght >= 2 && !timeSignatureFound) {
+                        timeSignatureFound = true;
+                        if (info->timeSignatureTrack < 0 || tick < info->timeSignatureTick) {
+                            info->timeSignatureNumerator = trk.pos[0];
+                            info->timeSignatureDenominator = trk.pos[1];
+                            info->timeSignatureTick = tick;
+                            info->timeSignatureTrack = t;
+                        }
+                    }
+                } else if (status == 0xF0 || status == 0xF7) {
+                    lenght = readVariableLengthQuantity(&trk);
+                    lenght = std::min(lenght, remaining(&trk));
+                }
+                break;
+            default:
+                lenght = 2;
+                break;
         }
 
+        trk.pos += std::min(lenght, remaining(&trk));
     }
 
-    std::sort(fEvents.begin(), fEvents.end(), eventTickCompare);
-    std::sort(fTempoEvents.begin(), fTempoEvents.end(), eventTickCompare);
+    return tick;
+}
+
+bool MidiFile::read(const std::string &filename, bool seekFileChunkID) {
 
-    std::sort(fControllerEvents.begin(), fControllerEvents.end(), eventTickCompare);
-    std::sort(fProgramChangeEvents.begin(), fProgramChangeEvents.end(), eventTickCompare);
-    std::sort(fTimeSignatureEvents.begin(), fTimeSignatureEvents.end(), eventTickCompare);
-    //fEvents.sort(eventTickCompare);
-    //fTempoEvent.sort(eventTickCompare);
+    std::vector<unsigned char> buffer;
+    if (!readFileToBuffer(filename, &buffer))
+        return false;
 
-    in.close();
+    clear();
+
+    MidiFileInfo header;
+    std::vector<ByteCursor> chunks;
+    if (!readChunks(buffer, seekFileChunkID, &header, &chunks)) {
+        clear();
+        return false;
+    }
+
+    fFormatType = header.formatType;
+    fNumOfTracks = header.numberOfTracks;
+    fDivision = header.division;
+    fResolution = header.resolution;
+
+    std::vector<MidiTrackBuffer> tracks(fNumOfTracks);
+    // Starting a thread costs about as much as decoding a few KB, so
+    // small songs stay serial.
+    int workers = std::min(std::min(fReadThreads, fNumOfTracks), (int)(buffer.size() / 65536) + 1);
+
+    if (workers > 1) {
+        // Tracks are independent until the merge, each worker takes the
+        // next undecoded one.
+        std::atomic<int> next(0);
+        auto decodeNext = [&]() {
+            for (int t = next++; t < fNumOfTracks; t = next++)
+                decodeTrack(t, chunks[t], &tracks[t]);
+        };
+
+        std::vector<std::thread> threads;
+        for (int i=1; i<workers; i++)
+            threads.push_back(std::thread(decodeNext));
+        decodeNext();
+        for (std::thread &th : threads)
+            th.join();
+    } else {
+        for (int t=0; t<fNumOfTracks; t++)
+            decodeTrack(t, chunks[t], &tracks[t]);
+    }
+
+    mergeTracks(tracks);
+
+    buildTempoMap();
+    buildEventTimes();
 
     return true;
 }
 
-MidiEvent* MidiFile::createMidiEvent(int track, uint32_t tick, uint32_t delta, MidiEventType evType, int ch, int data1, int data2) {
-    MidiEvent *e = new MidiEvent();
-    e->setTrack(track);
-    e->setTick(tick);
-    e->setDelta(delta);
-    e->setEventType(evType);
-    e->setChannel(ch);
-    e->setData1(data1);
-    e->setData2(data2);
-    fEvents.push_back(e);
+bool MidiFile::readInfo(const std::string &filename, MidiFileInfo *info, bool seekFileChunkID) {
+
+    std::vector<unsigned char> buffer;
+    if (!readFileToBuffer(filename, &buffer))
+        return false;
 
-    return e;
-}
-
-MidiEvent* MidiFile::createMetaEvent(int track, uint32_t tick, uint32_t delta, int number, std::vector<unsigned char> data) {
-    MidiEvent *me = new MidiEvent();
-    me->setTrack(track);
-    me->setTick(tick);
-    me->setDelta(delta);
-    me->setEventType(MidiEventType::Meta);
-    me->setMetaType(number);
-    me->setData(data);
-    fEvents.push_back(me);
-    if (me->metaEventType() == MidiMetaType::SetTempo)
-        fTempoEvents.push_back(me);
-    if (me->metaEventType() == MidiMetaType::TimeSignature)
-        fTimeSignatureEvents.push_back(me);
-
-    return me;
-}
-
-MidiEvent* MidiFile::createSysExEvent(int track, uint32_t tick, uint32_t delta, std::vector<unsigned char> data) {
-    MidiEvent *e = new MidiEvent();
-    e->setTrack(track);
-    e->setTick(tick);
-    e->setDelta(delta);
-    e->setEventType(MidiEventType::SysEx);
-    e->setData(data);
+    *info = MidiFileInfo();
+
+    std::vector<ByteCursor> chunks;
+    if (!readChunks(buffer, seekFileChunkID, info, &chunks))
+        return false;
+
+    info->trackEndTicks.resize(chunks.size());
+    for (size_t t=0; t<chunks.size(); t++)
+        info->trackEndTicks[t] = scanTrack(t, chunks[t], info);
+
+    return true;
+}
+
+int MidiFileInfo::bpm() const
+{
+    if (tempo == 0)
+        return 120;
+
+    return (float)(60000000.0 / tempo);
+}
+
+uint32_t MidiFileInfo::endTick() const
+{
+    uint32_t tick = 0;
+    for (uint32_t t : trackEndTicks)
+        tick = std::max(tick, t);
+
+    return tick;
+}
+
+// Tracks are each in tick order already, so a k-way merge gives the song
+// order directly. Ties go to the lower track, then to file order, which
+// keeps e.g. a program change ahead of a note on the same tick.
+void MidiFile::mergeTracks(std::vector<MidiTrackBuffer> &tracks)
+{
+    struct Cursor {
+        uint32_t tick;
+        int track;
+        MidiEvent *pos;
+        MidiEvent *end;
+        bool operator < (const Cursor &o) const {
+            return tick != o.tick ? tick > o.tick : track > o.track;
+        }
+    };
+
+    std::vector<Cursor> heap;
+    size_t total = 0;
+
+    for (size_t t=0; t<tracks.size(); t++) {
+        MidiTrackBuffer &tb = tracks[t];
+        if (tb.events.empty())
+            continue;
+
+        uint32_t payloadBase = fPayloads.size();
+        uint32_t dataBase = fPayloadData.size();
+        for (MidiPayload p : tb.payloads) {
+            p.offset += dataBase;
+            fPayloads.push_back(p);
+        }
+        fPayloadData.insert(fPayloadData.end(), tb.payloadData.begin(), tb.payloadData.end());
+
+        for (MidiEvent &e : tb.events) {
+            if (e.eventType() == MidiEventType::Meta || e.eventType() == MidiEventType::SysEx)
+                e.setPayloadIndex(e.payloadIndex() + payloadBase);
+        }
+
+        // The decoded track becomes a pool block as is, no copy
+        size_t count = tb.events.size();
+        MidiEvent *first = fEventPool.adopt(tb.events);
+        Cursor c = { first->tick(), (int)t, first, first + count };
+        heap.push_back(c);
+        total += count;
+    }
+
+    fEvents.reserve(total);
+    std::make_heap(heap.begin(), heap.end());
+
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end());
+        Cursor &c = heap.back();
+
+        // Take the whole run that stays ahead of the other tracks
+        bool last = heap.size() == 1;
+        Cursor next = heap.front();
+        do {
+            indexEvent(c.pos);
+            c.pos++;
+        } while (c.pos < c.end && (last || c.pos->tick() < next.tick
+                                   || (c.pos->tick() == next.tick && c.track < next.track)));
+
+        if (c.pos < c.end) {
+            c.tick = c.pos->tick();
+            std::push_heap(heap.begin(), heap.end());
+        } else {
+            heap.pop_back();
+        }
+    }
+}
+
+void MidiFile::indexEvent(MidiEvent *e)
+{
     fEvents.push_back(e);
 
-    return e;
+    switch (e->eventType()) {
+    case MidiEventType::Controller:
+        fControllerEvents.push_back(e);
+        break;
+    case MidiEventType::ProgramChange:
+        fProgramChangeEvents.push_back(e);
+        break;
+    case MidiEventType::Meta: {
+        const MidiPayload &p = fPayloads[e->payloadIndex()];
+        if (e->metaEventType() == MidiMetaType::SetTempo && p.value > 0)
+            fTempoEvents.push_back(e);
+        else if (e->metaEventType() == MidiMetaType::TimeSignature && p.size >= 2)
+            fTimeSignatureEvents.push_back(e);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+const unsigned char* MidiFile::data(const MidiEvent *e) {
+    if (e->eventType() != MidiEventType::Meta && e->eventType() != MidiEventType::SysEx)
+        return nullptr;
+
+    return fPayloadData.data() + fPayloads[e->payloadIndex()].offset;
+}
+
+uint32_t MidiFile::dataSize(const MidiEvent *e) {
+    if (e->eventType() != MidiEventType::Meta && e->eventType() != MidiEventType::SysEx)
+        return 0;
+
+    return fPayloads[e->payloadIndex()].size;
+}
+
+float MidiFile::tempoBpm(const MidiEvent *e) {
+    uint32_t midi_tempo = tempoMicroseconds(e);
+    if (midi_tempo == 0)
+        return 0;
+
+    return (float)(60000000.0 / midi_tempo);
+}
+
+uint32_t MidiFile::tempoMicroseconds(const MidiEvent *e) {
+    if ((e->eventType() != MidiEventType::Meta) || (e->metaEventType() != MidiMetaType::SetTempo))
+        return 0;
+
+    return fPayloads[e->payloadIndex()].value;
+}
+
+int MidiFile::timeSignatureNumerator(const MidiEvent *e) {
+    if ((e->eventType() != MidiEventType::Meta) || (e->metaEventType() != MidiMetaType::TimeSignature))
+        return 0;
+
+    return fPayloads[e->payloadIndex()].value & 0xFF;
+}
+
+int MidiFile::timeSignatureDenominator(const MidiEvent *e) {
+    if ((e->eventType() != MidiEventType::Meta) || (e->metaEventType() != MidiMetaType::TimeSignature))
+        return 0;
+
+    return (fPayloads[e->payloadIndex()].value >> 8) & 0xFF;
 }
 
 float MidiFile::beatFromTick(uint32_t tick)
@@ -335,101 +691,246 @@ float MidiFile::beatFromTick(uint32_t tick)
 
 float MidiFile::timeFromTick(uint32_t tick)
 {
-    switch (fDivision) {
-    case PPQ: {
-        float tempo_event_time = 0.0;
-        uint32_t tempo_event_tick = 0;
-        float tempo = 120.0;
+    return microsecondsFromTick(tick) / 1000000.0;
+}
 
-        for (MidiEvent* e : fTempoEvents) {
-            if (e->tick() >= tick) {
-                break;
-            }
-            tempo_event_time +=(((float)(e->tick() - tempo_event_tick)) / fResolution / (tempo / 60));
-            tempo_event_tick = e->tick();
-            tempo = e->tempoBpm();
-        }
+uint32_t MidiFile::tickFromTime(float time)
+{
+    if (time <= 0)
+        return 0;
 
-        float time =tempo_event_time + (((float)(tick - tempo_event_tick)) / fResolution / (tempo / 60));
-        return time;
-    }
-    case SMPTE24:
-        return (float)(tick) / (fResolution * 24.0);
-    case SMPTE25:
-        return (float)(tick) / (fResolution * 25.0);
-    case SMPTE30DROP:
-        return (float)(tick) / (fResolution * 29.97);
-    case SMPTE30:
-        return (float)(tick) / (fResolution * 30.0);
-    default:
-        return 0.0f;
+    return tickFromMicroseconds(time * 1000000.0);
+}
+
+uint32_t MidiFile::tickFromTimeMs(float msTime)
+{
+    if (msTime <= 0)
+        return 0;
+
+    return tickFromMicroseconds(msTime * 1000.0);
+}
+
+// Frames per 100 seconds, SMPTE ticks are fResolution sub frames of a frame.
+int smpteFramesPer100Sec(MidiFile::DivisionType d) {
+    switch (d) {
+    case MidiFile::SMPTE24:     return 2400;
+    case MidiFile::SMPTE25:     return 2500;
+    case MidiFile::SMPTE30DROP: return 2997;
+    case MidiFile::SMPTE30:     return 3000;
+    default:                    return 0;
     }
 }
 
-uint32_t MidiFile::tickFromTime(float time)
+uint64_t MidiFile::microsecondsFromTick(uint32_t tick)
 {
-    switch (fDivision) {
-    case PPQ: {
-        float tempo_event_time = 0.0;
-        uint32_t tempo_event_tick = 0;
-        float tempo = 120.0;
-
-        for (MidiEvent* e : fTempoEvents) {
-            float next_tempo_event_time =
-                tempo_event_time +
-                (((float)(e->tick() - tempo_event_tick)) / fResolution / (tempo / 60));
-            if (next_tempo_event_time >= time) break;
-            tempo_event_time = next_tempo_event_time;
-            tempo_event_tick = e->tick();
-            tempo = e->tempoBpm();
-        }
+    if (fResolution <= 0)
+        return 0;
 
-        return tempo_event_tick + (uint32_t)((time - tempo_event_time) * (tempo / 60) * fResolution);
+    if (fDivision != PPQ) {
+        uint64_t fps = smpteFramesPer100Sec(fDivision);
+        return fps ? (uint64_t)tick * 100000000 / (fps * fResolution) : 0;
     }
-    case SMPTE24:
-        return (uint32_t)(time * fResolution * 24.0);
-    case SMPTE25:
-        return (uint32_t)(time * fResolution * 25.0);
-    case SMPTE30DROP:
-        return (uint32_t)(time * fResolution * 29.97);
-    case SMPTE30:
-        return (uint32_t)(time * fResolution * 30.0);
-    default:
+
+    // Last tempo point at or before tick
+    std::vector<MidiTempoPoint>::const_iterator it = std::upper_bound(
+                fTempoMap.begin(), fTempoMap.end(), tick,
+                [](uint32_t t, const MidiTempoPoint &p) { return t < p.tick; });
+    const MidiTempoPoint &p = *(it - 1);
+
+    return (p.scaledTime + (uint64_t)(tick - p.tick) * p.microsecondsPerQuarter) / fResolution;
+}
+
+uint32_t MidiFile::tickFromMicroseconds(uint64_t us)
+{
+    if (fResolution <= 0)
         return 0;
+
+    if (fDivision != PPQ) {
+        uint64_t fps = smpteFramesPer100Sec(fDivision);
+        return us * fps * fResolution / 100000000;
     }
+
+    // Last tick whose time, rounded down like microsecondsFromTick(),
+    // is not after us
+    uint64_t scaled = (us + 1) * fResolution - 1;
+
+    std::vector<MidiTempoPoint>::const_iterator it = std::upper_bound(
+                fTempoMap.begin(), fTempoMap.end(), scaled,
+                [](uint64_t t, const MidiTempoPoint &p) { return t < p.scaledTime; });
+    const MidiTempoPoint &p = *(it - 1);
+
+    return p.tick + (scaled - p.scaledTime) / p.microsecondsPerQuarter;
 }
 
-uint32_t MidiFile::tickFromTimeMs(float msTime)
+void MidiFile::buildTempoMap()
 {
-    switch (fDivision) {
-    case PPQ: {
-        float tempo_event_time = 0.0;
-        uint32_t tempo_event_tick = 0;
-        float tempo = 120.0;
-
-        for (MidiEvent* e : fTempoEvents) {
-            float next_tempo_event_time =
-                tempo_event_time +
-                (((float)(e->tick() - tempo_event_tick)) / fResolution / (tempo / 60000));
-            if (next_tempo_event_time >= msTime) break;
-            tempo_event_time = next_tempo_event_time;
-            tempo_event_tick = e->tick();
-            tempo = e->tempoBpm();
+    fTempoMap.clear();
+
+    MidiTempoPoint p;
+    p.tick = 0;
+    p.microsecondsPerQuarter = 500000; // 120 bpm until the first tempo event
+    p.scaledTime = 0;
+    fTempoMap.push_back(p);
+
+    for (const MidiEvent *e : fTempoEvents) {
+        MidiTempoPoint &last = fTempoMap.back();
+        uint32_t tempo = tempoMicroseconds(e);
+
+        if (e->tick() == last.tick) {
+            last.microsecondsPerQuarter = tempo;
+            continue;
         }
 
-        return tempo_event_tick + (uint32_t)((msTime - tempo_event_time) * (tempo / 60000) * fResolution);
+        p.scaledTime = last.scaledTime + (uint64_t)(e->tick() - last.tick) * last.microsecondsPerQuarter;
+        p.tick = e->tick();
+        p.microsecondsPerQuarter = tempo;
+        fTempoMap.push_back(p);
     }
-    case SMPTE24:
-        return (uint32_t)(msTime * fResolution * 24.0) * 1000;
-    case SMPTE25:
-        return (uint32_t)(msTime * fResolution * 25.0) * 1000;
-    case SMPTE30DROP:
-        return (uint32_t)(msTime * fResolution * 29.97) * 1000;
-    case SMPTE30:
-        return (uint32_t)(msTime * fResolution * 30.0) * 1000;
-    default:
-        return 0;
+}
+
+void MidiFile::buildEventTimes()
+{
+    fEventTimes.resize(fEvents.size());
+
+    if (fDivision != PPQ || fResolution <= 0) {
+        for (size_t i=0; i<fEvents.size(); i++)
+            fEventTimes[i] = microsecondsFromTick(fEvents[i]->tick());
+        return;
+    }
+
+    // Events are sorted, so walk the tempo map along with them
+    size_t t = 0;
+    for (size_t i=0; i<fEvents.size(); i++) {
+        uint32_t tick = fEvents[i]->tick();
+        while (t + 1 < fTempoMap.size() && fTempoMap[t + 1].tick <= tick)
+            t++;
+
+        const MidiTempoPoint &p = fTempoMap[t];
+        fEventTimes[i] = (p.scaledTime + (uint64_t)(tick - p.tick) * p.microsecondsPerQuarter) / fResolution;
     }
 }
 
+int MidiFile::eventIndexFromMicroseconds(uint64_t us)
+{
+    return std::lower_bound(fEventTimes.begin(), fEventTimes.end(), us) - fEventTimes.begin();
+}
 
+// Layout written by serialize(), every section starts 8 byte aligned
+struct MidiFileImage {
+    int32_t formatType;
+    int32_t numberOfTracks;
+    int32_t resolution;
+    int32_t division;
+    uint32_t eventCount;
+    uint32_t payloadCount;
+    uint32_t payloadDataSize;
+    uint32_t tempoPointCount;
+};
+
+size_t alignedSize(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+void appendBytes(std::vector<unsigned char> *out, const void *data, size_t size) {
+    size_t pos = out->size();
+    out->resize(pos + alignedSize(size), 0);
+    if (size > 0)
+        memcpy(out->data() + pos, data, size);
+}
+
+const unsigned char* takeBytes(ByteCursor *c, size_t size) {
+    if (remaining(c) < alignedSize(size)) {
+        c->ok = false;
+        return nullptr;
+    }
+    const unsigned char *p = c->pos;
+    c->pos += alignedSize(size);
+    return p;
+}
+
+void MidiFile::serialize(std::vector<unsigned char> *out) const
+{
+    MidiFileImage img;
+    img.formatType = fFormatType;
+    img.numberOfTracks = fNumOfTracks;
+    img.resolution = fResolution;
+    img.division = fDivision;
+    img.eventCount = fEvents.size();
+    img.payloadCount = fPayloads.size();
+    img.payloadDataSize = fPayloadData.size();
+    img.tempoPointCount = fTempoMap.size();
+
+    out->reserve(out->size() + sizeof(img) + fEvents.size() * (sizeof(MidiEvent) + sizeof(uint64_t))
+                 + fPayloads.size() * sizeof(MidiPayload) + fPayloadData.size()
+                 + fTempoMap.size() * sizeof(MidiTempoPoint) + 64);
+
+    appendBytes(out, &img, sizeof(img));
+
+    size_t pos = out->size();
+    out->resize(pos + alignedSize(fEvents.size() * sizeof(MidiEvent)), 0);
+    MidiEvent *events = reinterpret_cast<MidiEvent*>(out->data() + pos);
+    for (size_t i=0; i<fEvents.size(); i++)
+        events[i] = *fEvents[i];
+
+    appendBytes(out, fEventTimes.data(), fEventTimes.size() * sizeof(uint64_t));
+    appendBytes(out, fPayloads.data(), fPayloads.size() * sizeof(MidiPayload));
+    appendBytes(out, fPayloadData.data(), fPayloadData.size());
+    appendBytes(out, fTempoMap.data(), fTempoMap.size() * sizeof(MidiTempoPoint));
+}
+
+bool MidiFile::deserialize(const unsigned char *data, size_t size)
+{
+    clear();
+
+    ByteCursor in = { data, data + size, true };
+    MidiFileImage img;
+    const unsigned char *p = takeBytes(&in, sizeof(img));
+    if (p == nullptr)
+        return false;
+    memcpy(&img, p, sizeof(img));
+
+    const unsigned char *events = takeBytes(&in, (size_t)img.eventCount * sizeof(MidiEvent));
+    const unsigned char *times = takeBytes(&in, (size_t)img.eventCount * sizeof(uint64_t));
+    const unsigned char *payloads = takeBytes(&in, (size_t)img.payloadCount * sizeof(MidiPayload));
+    const unsigned char *payloadData = takeBytes(&in, img.payloadDataSize);
+    const unsigned char *tempoMap = takeBytes(&in, (size_t)img.tempoPointCount * sizeof(MidiTempoPoint));
+    if (!in.ok || img.tempoPointCount == 0)
+        return false;
+
+    fPayloads.resize(img.payloadCount);
+    memcpy(fPayloads.data(), payloads, fPayloads.size() * sizeof(MidiPayload));
+    for (const MidiPayload &pl : fPayloads) {
+        if (pl.offset > img.payloadDataSize || pl.size > img.payloadDataSize - pl.offset) {
+            clear();
+            return false;
+        }
+    }
+    fPayloadData.assign(payloadData, payloadData + img.payloadDataSize);
+
+    std::vector<MidiEvent> block(img.eventCount);
+    memcpy(block.data(), events, block.size() * sizeof(MidiEvent));
+    for (const MidiEvent &e : block) {
+        if ((e.eventType() == MidiEventType::Meta || e.eventType() == MidiEventType::SysEx)
+                && e.payloadIndex() >= img.payloadCount) {
+            clear();
+            return false;
+        }
+    }
+
+    fFormatType = img.formatType;
+    fNumOfTracks = img.numberOfTracks;
+    fResolution = img.resolution;
+    fDivision = (DivisionType)img.division;
+
+    fEventTimes.resize(img.eventCount);
+    memcpy(fEventTimes.data(), times, fEventTimes.size() * sizeof(uint64_t));
+    fTempoMap.resize(img.tempoPointCount);
+    memcpy(fTempoMap.data(), tempoMap, fTempoMap.size() * sizeof(MidiTempoPoint));
+
+    fEvents.reserve(img.eventCount);
+    MidiEvent *e = block.empty() ? nullptr : fEventPool.adopt(block);
+    for (uint32_t i=0; i<img.eventCount; i++)
+        indexEvent(e + i);
+
+    return true;
+}
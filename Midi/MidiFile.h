@@ -6,9 +6,52 @@
 #define MIDI_MIDIFILE_H
 
 #include "MidiEvent.h"
+#include "MidiEventPool.h"
 #include <istream>
 #include <list>
 
+// Meta and SysEx data, stored out of line in MidiFile::fPayloadData.
+// Tempo and time signature values are decoded once at load into value.
+struct MidiPayload {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t value;
+};
+
+// Read-only view over one of the event lists of a MidiFile. Cheap to copy,
+// valid until the next read()/clear() of the file it came from.
+class MidiEventSpan {
+public:
+    typedef const MidiEvent* const* iterator;
+
+    MidiEventSpan() : first(nullptr), last(nullptr) {}
+    MidiEventSpan(const std::vector<MidiEvent*> &v) : first(v.data()), last(v.data() + v.size()) {}
+
+    iterator begin() const  { return first; }
+    iterator end() const    { return last; }
+    size_t size() const     { return last - first; }
+    bool empty() const      { return first == last; }
+    const MidiEvent* operator [] (size_t i) const { return first[i]; }
+    const MidiEvent* front() const { return *first; }
+    const MidiEvent* back() const  { return *(last - 1); }
+
+private:
+    iterator first;
+    iterator last;
+};
+
+// Start of a constant tempo segment. scaledTime is the time of tick in
+// microseconds multiplied by the file resolution, which keeps the prefix
+// sums exact integers.
+struct MidiTempoPoint {
+    uint32_t tick;
+    uint32_t microsecondsPerQuarter;
+    uint64_t scaledTime;
+};
+
+struct MidiTrackBuffer;
+struct MidiFileInfo;
+
 class MidiFile {
 public:
     enum DivisionType {
@@ -29,24 +72,50 @@ public:
     int bpm();
 
     DivisionType divisionType() { return fDivision; }
-    std::vector<MidiEvent*> events() { return fEvents; }
-    std::vector<MidiEvent*> tempoEvents() { return fTempoEvents; }
-    std::vector<MidiEvent*> controllerEvents() { return fControllerEvents; }
-    std::vector<MidiEvent*> programChangeEvents() { return fProgramChangeEvents; }
-    std::vector<MidiEvent*> timeSignatureEvents() { return fTimeSignatureEvents; }
-    std::vector<MidiEvent*> controllerAndProgramEvents();
+    MidiEventSpan events() const { return fEvents; }
+    MidiEventSpan tempoEvents() const { return fTempoEvents; }
+    MidiEventSpan controllerEvents() const { return fControllerEvents; }
+    MidiEventSpan programChangeEvents() const { return fProgramChangeEvents; }
+    MidiEventSpan timeSignatureEvents() const { return fTimeSignatureEvents; }
+    std::vector<const MidiEvent*> controllerAndProgramEvents();
 
     void clear();
     bool read(const std::string &filename, bool seekFileChunkID = false);
+    // Header, first tempo, first time signature and track lengths only,
+    // nothing is decoded or allocated per event.
+    static bool readInfo(const std::string &filename, MidiFileInfo *info, bool seekFileChunkID = false);
+
+    // Parsed song as one flat image, for SongCache. deserialize() expects
+    // the bytes of a serialize() from the same build.
+    void serialize(std::vector<unsigned char> *out) const;
+    bool deserialize(const unsigned char *data, size_t size);
+
+    // Tracks decoded in parallel by read(), 1 (default) decodes serially
+    int readThreads() { return fReadThreads; }
+    void setReadThreads(int count) { fReadThreads = count > 0 ? count : 1; }
 
-    MidiEvent* createMidiEvent(int track, uint32_t tick, uint32_t delta, MidiEventType evType, int ch, int data1, int data2);
-    MidiEvent* createMetaEvent(int track, uint32_t tick, uint32_t delta, int number, std::vector<unsigned char> data);
-    MidiEvent* createSysExEvent(int track, uint32_t tick, uint32_t delta, std::vector<unsigned char> data);
+    // Meta, SysEx payload. SysEx data starts with its status byte.
+    const unsigned char* data(const MidiEvent *e);
+    uint32_t dataSize(const MidiEvent *e);
+
+    float    tempoBpm(const MidiEvent *e);
+    uint32_t tempoMicroseconds(const MidiEvent *e);
+    // Denominator is the power of 2, as stored in the file.
+    int      timeSignatureNumerator(const MidiEvent *e);
+    int      timeSignatureDenominator(const MidiEvent *e);
 
     float    beatFromTick(uint32_t tick);
     float    timeFromTick(uint32_t tick);
     uint32_t tickFromTime(float time);
     uint32_t tickFromTimeMs(float msTime);
+    uint64_t microsecondsFromTick(uint32_t tick);
+    uint32_t tickFromMicroseconds(uint64_t us);
+
+    // Absolute time of events()[index], computed once at load
+    uint64_t eventMicroseconds(int index) const { return fEventTimes[index]; }
+    uint64_t durationMicroseconds() const { return fEventTimes.empty() ? 0 : fEventTimes.back(); }
+    // Index of the first event at or after us, events().size() when none
+    int      eventIndexFromMicroseconds(uint64_t us);
 
 
 private:
@@ -54,12 +123,43 @@ private:
     int fNumOfTracks;
     int fResolution;
     DivisionType fDivision;
+    int fReadThreads;
+    MidiEventPool fEventPool;
     std::vector<MidiEvent*> fEvents;
     std::vector<MidiEvent*> fTempoEvents;
     std::vector<MidiEvent*> fControllerEvents;
     std::vector<MidiEvent*> fProgramChangeEvents;
     std::vector<MidiEvent*> fTimeSignatureEvents;
+    std::vector<MidiPayload> fPayloads;
+    std::vector<unsigned char> fPayloadData;
+    std::vector<MidiTempoPoint> fTempoMap;
+    std::vector<uint64_t> fEventTimes;
+
+    void buildTempoMap();
+    void buildEventTimes();
+    void mergeTracks(std::vector<MidiTrackBuffer> &tracks);
+    void indexEvent(MidiEvent *e);
 };
 
+// Result of MidiFile::readInfo(). The first tempo and time signature are
+// the earliest in the song, ties going to the lower track like read().
+struct MidiFileInfo {
+    int formatType = 1;
+    int numberOfTracks = 0;
+    int resolution = 0;
+    MidiFile::DivisionType division = MidiFile::PPQ;
+
+    uint32_t tempo = 0;                 // Microseconds per quarter, 0 when none
+    uint32_t tempoTick = 0;
+    int timeSignatureNumerator = 0;
+    int timeSignatureDenominator = 0;   // Power of 2, as stored in the file
+    uint32_t timeSignatureTick = 0;
+    int timeSignatureTrack = -1;        // -1 when none
+
+    std::vector<uint32_t> trackEndTicks;
+
+    int bpm() const;
+    uint32_t endTick() const;
+};
 
 #endif //MIDI_MIDIFILE_H
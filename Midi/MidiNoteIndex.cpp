@@ -0,0 +1,123 @@
+#include "MidiNoteIndex.h"
+
+#include <algorithm>
+
+void MidiNoteIndex::build(MidiEventSpan events)
+{
+    clear();
+
+    // Note ons waiting for their note off, per channel and note. Repeated
+    // note ons are paired first in, first out.
+    struct Open { uint32_t tick; uint8_t velocity; };
+    std::vector<std::vector<Open>> open(16 * 128);
+    std::vector<size_t> first(16 * 128, 0);
+
+    for (const MidiEvent *e : events) {
+        MidiEventType type = e->eventType();
+        if (type != MidiEventType::NoteOn && type != MidiEventType::NoteOff)
+            continue;
+
+        int ch = e->channel();
+        int note = e->data1() & 0x7F;
+        int velocity = e->data2() & 0x7F;
+        std::vector<Open> &q = open[ch * 128 + note];
+        size_t &head = first[ch * 128 + note];
+
+        if (type == MidiEventType::NoteOn && velocity > 0) {
+            q.push_back({ e->tick(), (uint8_t)velocity });
+            continue;
+        }
+        if (head == q.size())
+            continue;
+
+        Open o = q[head++];
+        if (head == q.size()) {
+            q.clear();
+            head = 0;
+        }
+        if (e->tick() > o.tick)
+            fNotes.push_back({ o.tick, e->tick(), 0, (uint8_t)ch, (uint8_t)note, o.velocity });
+    }
+
+    for (int i=0; i<16 * 128; i++) {
+        for (size_t j=first[i]; j<open[i].size(); j++) {
+            const Open &o = open[i][j];
+            fNotes.push_back({ o.tick, UINT32_MAX, 0, (uint8_t)(i / 128), (uint8_t)(i % 128), o.velocity });
+        }
+    }
+
+    std::sort(fNotes.begin(), fNotes.end(),
+              [](const MidiNoteInterval &a, const MidiNoteInterval &b) { return a.start < b.start; });
+
+    // Implicit tree: node i is on level k when its k lowest bits are 1,
+    // its children are i -/+ 2^(k-1). Leaves are the even indexes.
+    size_t n = fNotes.size();
+    if (n == 0)
+        return;
+
+    size_t lastIndex = 0;
+    uint32_t last = 0;
+    for (size_t i=0; i<n; i+=2) {
+        lastIndex = i;
+        last = fNotes[i].maxEnd = fNotes[i].end;
+    }
+
+    int k = 1;
+    for (; ((size_t)1 << k) <= n; k++) {
+        size_t x = (size_t)1 << (k - 1);
+        size_t first = (x << 1) - 1;
+        size_t step = x << 2;
+        for (size_t i=first; i<n; i+=step) {
+            uint32_t left = fNotes[i - x].maxEnd;
+            // Missing right subtrees take the max of the last node built
+            uint32_t right = i + x < n ? fNotes[i + x].maxEnd : last;
+            fNotes[i].maxEnd = std::max(fNotes[i].end, std::max(left, right));
+        }
+        lastIndex = (lastIndex >> k & 1) ? lastIndex - x : lastIndex + x;
+        if (lastIndex < n && fNotes[lastIndex].maxEnd > last)
+            last = fNotes[lastIndex].maxEnd;
+    }
+    fMaxLevel = k - 1;
+}
+
+void MidiNoteIndex::clear()
+{
+    fNotes.clear();
+    fNotes.shrink_to_fit();
+    fMaxLevel = -1;
+}
+
+void MidiNoteIndex::notesAt(uint32_t tick, std::vector<const MidiNoteInterval*> *out) const
+{
+    out->clear();
+    if (fMaxLevel < 0)
+        return;
+
+    struct Node { size_t x; int k; bool leftDone; };
+    Node stack[128];
+    int top = 0;
+    stack[top++] = { ((size_t)1 << fMaxLevel) - 1, fMaxLevel, false };
+
+    size_t n = fNotes.size();
+    while (top > 0) {
+        Node z = stack[--top];
+        if (z.k <= 3) {
+            // Small subtree, scan it
+            size_t i = z.x >> z.k << z.k;
+            size_t end = std::min(n, i + ((size_t)1 << (z.k + 1)) - 1);
+            for (; i < end && fNotes[i].start < tick; i++) {
+                if (fNotes[i].end > tick)
+                    out->push_back(&fNotes[i]);
+            }
+        } else if (!z.leftDone) {
+            size_t left = z.x - ((size_t)1 << (z.k - 1));
+            stack[top++] = { z.x, z.k, true };
+            if (left >= n || fNotes[left].maxEnd > tick)
+                stack[top++] = { left, z.k - 1, false };
+        } else if (z.x < n && fNotes[z.x].start < tick) {
+            if (fNotes[z.x].end > tick)
+                out->push_back(&fNotes[z.x]);
+            stack[top++] = { z.x + ((size_t)1 << (z.k - 1)), z.k - 1, false };
+        }
+    }
+}
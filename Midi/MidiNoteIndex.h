@@ -0,0 +1,45 @@
+#ifndef MIDINOTEINDEX_H
+#define MIDINOTEINDEX_H
+
+#include "MidiFile.h"
+
+#include <cstdint>
+#include <vector>
+
+// One sounding note, from its note on to its note off tick. Notes never
+// turned off end at UINT32_MAX.
+struct MidiNoteInterval {
+    uint32_t start;
+    uint32_t end;
+    uint32_t maxEnd;    // Largest end in the subtree, see MidiNoteIndex
+    uint8_t  channel;
+    uint8_t  note;
+    uint8_t  velocity;
+};
+
+/*
+    Note intervals of a song, for chasing held notes after a seek.
+
+        Intervals are sorted by start and laid out as an implicit binary
+        tree over the array, each node keeping the largest end below it,
+        so notesAt() runs in O(log n + k).
+*/
+
+class MidiNoteIndex
+{
+public:
+    void build(MidiEventSpan events);
+    void clear();
+
+    size_t size() { return fNotes.size(); }
+
+    // Notes started before tick and not yet off at tick. Notes starting or
+    // ending exactly at tick are left to the events at tick.
+    void notesAt(uint32_t tick, std::vector<const MidiNoteInterval*> *out) const;
+
+private:
+    std::vector<MidiNoteInterval> fNotes;
+    int fMaxLevel = -1;
+};
+
+#endif // MIDINOTEINDEX_H
@@ -4,16 +4,33 @@
 #include <QtMath>
 #include <QDebug>
 
+#include <cstring>
+#include <algorithm>
+
+#ifdef Q_OS_LINUX
+#include <time.h>
+#include <errno.h>
+#endif
+
 MidiPlayer::MidiPlayer(QObject *parent) : QThread(parent)
 {
     _midi       = new MidiFile();
+    _midi->setReadThreads(QThread::idealThreadCount());
     _midiOut    = new MidiOut();
     _midiSynth  = new MidiSynthesizer();
     _eTimer     = new QElapsedTimer();
+    for (int i = 0; i < 8; i++)
+        _lateness[i] = 0;
+
+    // One thread for the player's whole life, driven by postCommand()
+    QThread::start(QThread::TimeCriticalPriority);
 }
 
 MidiPlayer::~MidiPlayer()
 {
+    postCommand(Quit);
+    wait();
+
     delete _eTimer;
     delete _midiSynth;
     delete _midiOut;
@@ -66,18 +83,9 @@ bool MidiPlayer::load(std::string file, bool seekFileChunkID)
     if (!_stopped)
         stop();
 
-    if (!_midi->read(file, seekFileChunkID))
+    if (!_midi->read(file, seekFileChunkID) || _midi->events().empty())
         return false;
 
-    MidiEvent *e = _midi->events().back();
-    _durationTick = e->tick();
-    _durationMs = _midi->timeFromTick(e->tick()) * 1000;
-    _midiTranspose = 0;
-
-    tempo_scale = 100;
-
-    _finished = false;
-
     { // Calculate beat count
         uint32_t t = _midi->events().back()->tick();
         _midiBeatCount = _midi->beatFromTick(t);
@@ -85,20 +93,96 @@ bool MidiPlayer::load(std::string file, bool seekFileChunkID)
         _beatInBar.clear();
         int beatCalculed = 0;
         int nBeatInBar = 0;
-        for (MidiEvent *evt : _midi->timeSignatureEvents()) {
+        for (const MidiEvent *evt : _midi->timeSignatureEvents()) {
             if (nBeatInBar > 0) {
                 int nBeat = _midi->beatFromTick(evt->tick()) - beatCalculed;
                 int nBar = nBeat / nBeatInBar;
                 beatCalculed += nBeat;
                 _beatInBar.insertMulti(nBeatInBar, nBar);
             }
-            nBeatInBar = getNumberBeatInBar(evt->data()[0], evt->data()[1]);
+            nBeatInBar = getNumberBeatInBar(_midi->timeSignatureNumerator(evt),
+                                            _midi->timeSignatureDenominator(evt));
         }
         int nBeat = _midiBeatCount - beatCalculed;
         int nBar = nBeat / nBeatInBar;
         _beatInBar.insertMulti(nBeatInBar, nBar);
     } // End calculate beat count
 
+    songLoaded();
+
+    return true;
+}
+
+void MidiPlayer::saveCache(std::vector<unsigned char> *out)
+{
+    // Song image size, song image, beat count, beat map pairs
+    size_t start = out->size();
+    out->resize(start + sizeof(uint64_t));
+    _midi->serialize(out);
+    uint64_t midiSize = out->size() - start - sizeof(uint64_t);
+    memcpy(out->data() + start, &midiSize, sizeof(midiSize));
+
+    std::vector<int32_t> beats;
+    beats.push_back(_midiBeatCount);
+    for (QMap<int, int>::const_iterator it = _beatInBar.constBegin(); it != _beatInBar.constEnd(); ++it) {
+        beats.push_back(it.key());
+        beats.push_back(it.value());
+    }
+    const unsigned char *b = reinterpret_cast<const unsigned char*>(beats.data());
+    out->insert(out->end(), b, b + beats.size() * sizeof(int32_t));
+}
+
+bool MidiPlayer::loadCache(const unsigned char *data, size_t size)
+{
+    if (!_stopped)
+        stop();
+
+    uint64_t midiSize = 0;
+    if (size >= sizeof(midiSize))
+        memcpy(&midiSize, data, sizeof(midiSize));
+    data += sizeof(midiSize);
+    size -= std::min(size, sizeof(midiSize));
+
+    if (midiSize > size || (size - midiSize) % sizeof(int32_t) != 0 || size - midiSize < sizeof(int32_t)
+            || !_midi->deserialize(data, midiSize) || _midi->events().empty())
+        return false;
+
+    std::vector<int32_t> beats((size - midiSize) / sizeof(int32_t));
+    if (beats.size() % 2 == 0)
+        return false;
+    memcpy(beats.data(), data + midiSize, beats.size() * sizeof(int32_t));
+
+    _midiBeatCount = beats[0];
+    _beatInBar.clear();
+    // insertMulti() puts the newest value first, so walk backwards to keep
+    // the order the map had when it was saved
+    for (size_t i = beats.size() - 1; i >= 2; i -= 2)
+        _beatInBar.insertMulti(beats[i - 1], beats[i]);
+
+    songLoaded();
+
+    return true;
+}
+
+void MidiPlayer::songLoaded()
+{
+    _durationTick = _midi->events().back()->tick();
+    _durationMs = _midi->durationMicroseconds() / 1000;
+    _midiTranspose = 0;
+
+    tempo_scale = 100;
+
+    // A checkpoint every 16 beats, or every 1920 ticks for SMPTE timing
+    int resolution = _midi->divisionType() == MidiFile::PPQ ? _midi->resorution() : 120;
+    _seekIndex.build(_midi->events(), resolution > 0 ? resolution * 16 : 1920);
+    _noteIndex.build(_midi->events());
+    MidiSynthesizer::compile(_midi->events(), &_synthProgram);
+    preloadSongPresets();
+
+    _finished = false;
+    for (int i = 0; i < 8; i++)
+        _lateness[i] = 0;
+
     for (int i=0; i<16; i++) {
         _midiChannels[i].setInstrument(0);
         _midiChannels[i].setVolume(100);
@@ -109,28 +193,44 @@ bool MidiPlayer::load(std::string file, bool seekFileChunkID)
     }
     _midiChannels[9].setInstrumentType(InstrumentType::PercussionEtc);
     emit loaded();
+}
 
-    return true;
+void MidiPlayer::play()
+{
+    postCommand(Play);
 }
 
 void MidiPlayer::stop(bool resetPos)
 {
-    if (_stopped)
+    if (_stopped && !resetPos)
         return;
 
-    _playing = false;
-    _stopped = false;
-    _finished = false;
+    postCommand(resetPos ? Stop : Pause);
+}
+
+void MidiPlayer::postCommand(CommandType type, int tick)
+{
+    if (QThread::currentThread() == this)
+        return;
 
-    while (!isFinished()) {};
+    QMutexLocker locker(&_commandMutex);
 
-    if (resetPos) {
-        _stopped = true;
-        _startPlayTime = 0;
-        _playedIndex = 0;
-        _positionMs = 0;
-        _positionTick = 0;
-    }
+    Command c;
+    c.type = type;
+    c.tick = tick;
+    _commands.enqueue(c);
+    quint64 id = ++_commandsPosted;
+    _commandCond.wakeAll();
+
+    // Callers read the player state right after, so wait until it is done
+    while (_commandsDone < id)
+        _commandDoneCond.wait(&_commandMutex);
+}
+
+bool MidiPlayer::hasPendingCommand()
+{
+    QMutexLocker locker(&_commandMutex);
+    return !_commands.isEmpty();
 }
 
 void MidiPlayer::setVolume(int v)
@@ -289,26 +389,131 @@ void MidiPlayer::setChorus(int ch, int v)
 
 void MidiPlayer::setPositionTick(int t)
 {
-    bool playAfterSeek = _playing;
-    if (_playing)
-        stop();
+    postCommand(Seek, t);
+}
 
-    int index = 0;
-    for (MidiEvent *e :_midi->events()) {
-        if (e->tick() > t)
-            break;
+void MidiPlayer::seek(int t)
+{
+    MidiEventSpan events = _midi->events();
+    MidiChannelState state;
+    int index = _seekIndex.stateAt(events, t < 0 ? 0 : t, &state);
+
+    bool batch = _midiPortNum == -1;
+    if (batch)
+        _midiSynth->setQueueing(true, false);
+    sendChannelState(state);
+    if (batch) {
+        _midiSynth->flushEvents();
+        _midiSynth->setQueueing(false);
+    }
 
-        if (e->eventType() == MidiEventType::Controller
-            || e->eventType() == MidiEventType::ProgramChange) {
-            sendEvent(e);
+    if (index > 0)
+        _positionTick = events[index - 1]->tick();
+    _playedIndex = index;
+    _positionMs = index > 0 ? _midi->eventMicroseconds(index - 1) / 1000 : 0;
+}
+
+void MidiPlayer::sendChannelState(const MidiChannelState &state)
+{
+    // Bank before program, RPN selectors before their data entry, the rest
+    // in any order. Controllers the song never set are left to the reset.
+    MidiEvent e;
+    for (int ch=0; ch<16; ch++) {
+        const uint8_t *cc = state.controller[ch];
+        e.setChannel(ch);
+
+        e.setEventType(MidiEventType::Controller);
+        auto sendCC = [&](int number, int value) {
+            e.setData1(number);
+            e.setData2(value);
+            sendEvent(&e);
+        };
+
+        sendCC(121, 0);
+        if (cc[0] != 0xFF)
+            sendCC(0, cc[0]);
+        if (cc[32] != 0xFF)
+            sendCC(32, cc[32]);
+
+        if (state.program[ch] != 0xFF) {
+            e.setEventType(MidiEventType::ProgramChange);
+            e.setData1(state.program[ch]);
+            e.setData2(0);
+            sendEvent(&e);
+            e.setEventType(MidiEventType::Controller);
+        }
+
+        for (int n=1; n<120; n++) {
+            if (cc[n] == 0xFF || n == 6 || n == 32 || n == 38 || (n >= 98 && n <= 101))
+                continue;
+            sendCC(n, cc[n]);
+        }
+
+        for (int rpn=0; rpn<3; rpn++) {
+            if (state.rpnMsb[ch][rpn] == 0xFF && state.rpnLsb[ch][rpn] == 0xFF)
+                continue;
+            sendCC(101, 0);
+            sendCC(100, rpn);
+            if (state.rpnMsb[ch][rpn] != 0xFF)
+                sendCC(6, state.rpnMsb[ch][rpn]);
+            if (state.rpnLsb[ch][rpn] != 0xFF)
+                sendCC(38, state.rpnLsb[ch][rpn]);
+        }
+
+        int msb = state.nrpnSelected[ch] ? 99 : 101;
+        int lsb = state.nrpnSelected[ch] ? 98 : 100;
+        if (cc[msb] != 0xFF)
+            sendCC(msb, cc[msb]);
+        if (cc[lsb] != 0xFF)
+            sendCC(lsb, cc[lsb]);
+        if (cc[6] != 0xFF)
+            sendCC(6, cc[6]);
+        if (cc[38] != 0xFF)
+            sendCC(38, cc[38]);
+
+        if (state.pitchBend[ch] != 0xFFFF) {
+            e.setEventType(MidiEventType::PitchBend);
+            e.setData1(state.pitchBend[ch]);
+            e.setData2(0);
+            sendEvent(&e);
         }
-        _positionTick = e->tick();
-        index++;
     }
+}
 
-    _playedIndex = index;
-    if (playAfterSeek)
-        start();
+void MidiPlayer::chaseNotes(uint32_t tick)
+{
+    _noteIndex.notesAt(tick, &_chasedNotes);
+
+    MidiEvent e;
+    e.setEventType(MidiEventType::NoteOn);
+    for (const MidiNoteInterval *n : _chasedNotes) {
+        if (!isChannelAudible(n->channel))
+            continue;
+
+        // sendEvent() applies transpose and the drum locks
+        e.setChannel(n->channel);
+        e.setData1(n->note);
+        e.setData2(n->velocity);
+        sendEvent(&e);
+    }
+}
+
+bool MidiPlayer::isChannelAudible(int ch)
+{
+    if (_midiChannels[ch].isMute())
+        return false;
+
+    return !_useSolo || _midiChannels[ch].isSolo();
+}
+
+void MidiPlayer::setPositionMs(long ms)
+{
+    MidiEventSpan events = _midi->events();
+    int index = _midi->eventIndexFromMicroseconds(ms < 0 ? 0 : (uint64_t)ms * 1000);
+    if (index >= events.size())
+        index = events.size() - 1;
+
+    setPositionTick(events[index]->tick());
 }
 
 void MidiPlayer::setTranspose(int t)
@@ -330,9 +535,7 @@ void MidiPlayer::setTranspose(int t)
 int MidiPlayer::positionTick()
 {
     if (_playing) {
-        //float time = (_eTimer->elapsedMs() + _startPlayTime) / 1000;
-        float time = _eTimer->elapsed()  + _startPlayTime;
-        return _midi->tickFromTimeMs(time);
+        return _midi->tickFromMicroseconds((qint64)_startPlayTime * 1000 + tempoClock().songTime(playedMicroseconds()));
     } else {
         return _positionTick;
     }
@@ -368,7 +571,7 @@ void MidiPlayer::setLockDrum(bool lock, int number)
         ev.setChannel(9);
         ev.setData1(number);
         sendEvent(&ev);
-        emit playingEvents(&ev);
+        feedEvent(&ev);
     }
 }
 
@@ -405,12 +608,65 @@ void MidiPlayer::setLockBass(bool lock, int number)
             ev.setChannel(i);
             ev.setData1(number);
             sendEvent(&ev);
-            emit playingEvents(&ev);
+            feedEvent(&ev);
         }
     }
 }
 
 void MidiPlayer::run()
+{
+    forever {
+        Command c;
+        {
+            QMutexLocker locker(&_commandMutex);
+            while (_commands.isEmpty())
+                _commandCond.wait(&_commandMutex);
+            c = _commands.head();
+        }
+
+        switch (c.type) {
+        case Play:
+            startPlaying();
+            break;
+        case Pause:
+            _playing = false;
+            _stopped = false;
+            _finished = false;
+            break;
+        case Stop:
+            _playing = false;
+            _stopped = true;
+            _finished = false;
+            _startPlayTime = 0;
+            _playedIndex = 0;
+            _positionMs = 0;
+            _positionTick = 0;
+            break;
+        case Seek:
+            seek(c.tick);
+            break;
+        case Quit:
+            _playing = false;
+            break;
+        }
+
+        {
+            QMutexLocker locker(&_commandMutex);
+            _commands.dequeue();
+            _commandsDone++;
+            _commandDoneCond.wakeAll();
+        }
+
+        if (c.type == Quit)
+            return;
+
+        // Plays until the song ends or the next command comes in
+        if (_playing && !hasPendingCommand())
+            playEvents();
+    }
+}
+
+void MidiPlayer::startPlaying()
 {
     if (_playing)
         return;
@@ -426,44 +682,134 @@ void MidiPlayer::run()
             ev.setData1(0);
         }
         sendEvent(&ev);
-        emit playingEvents(&ev);
+        feedEvent(&ev);
     }
 
     _playing = true;
     _stopped = false;
     _finished = false;
-
-    playEvents();
 }
 
 long MidiPlayer::positionMs()
 {
-    return _playing ? _eTimer->elapsed() + _startPlayTime : _positionMs;
+    return _playing ? _startPlayTime + tempoClock().songTime(playedMicroseconds()) / 1000 : _positionMs;
+}
+
+MidiTempoClock MidiPlayer::tempoClock()
+{
+    // The player thread resets and rebases it under the same lock
+    QMutexLocker locker(&_commandMutex);
+    return _tempoClock;
+}
+
+qint64 MidiPlayer::playedMicroseconds()
+{
+    if (!_useAudioClock)
+        return _eTimer->nsecsElapsed() / 1000;
+
+    // What the listener hears now: the stream play position less the
+    // device latency, counted from where the first event was rendered.
+    qint64 heard = (qint64)_midiSynth->playPosition() - _midiSynth->latencySamples() - (qint64)_clockAnchorSample;
+    if (heard <= 0)
+        return 0;
+
+    return heard * 1000000 / _midiSynth->sampleRate();
 }
 
 void MidiPlayer::playEvents()
 {
-    if (_playedIndex > 0) {
-        uint32_t ti = _midi->events()[_playedIndex]->tick();
-        _startPlayTime = _midi->timeFromTick(ti) * 1000;
+    MidiEventSpan events = _midi->events();
+
+    if (_playedIndex > 0 && _playedIndex < events.size()) {
+        _startPlayTime = _midi->eventMicroseconds(_playedIndex) / 1000;
     }
 
+    // Lookahead: internal synth only, events go to BASS up to
+    // _lookaheadMs early with the stream sample they should play at.
+    // Rendering everything _lookaheadMs late keeps those positions ahead of
+    // the renderer even when it fills its buffer in bursts.
+    bool lookahead = _lookaheadMs > 0 && _midiPortNum == -1;
+    qint64 lookaheadUs = (qint64)_lookaheadMs * 1000;
+    QWORD anchorSample = 0;
+    if (lookahead) {
+        anchorSample = _midiSynth->decodePosition() + (QWORD)_lookaheadMs * _midiSynth->sampleRate() / 1000;
+        _midiSynth->setQueueing(true);
+    }
+    // Otherwise the internal synth gets each tick's events, drum channel
+    // fan-out included, in one BASS_MIDI_StreamEvents() call
+    bool batch = !lookahead && _midiPortNum == -1;
+    if (batch)
+        _midiSynth->setQueueing(true, false);
+    uint32_t batchTick = UINT32_MAX;
+    quint64 synthCalls = _midiSynth->streamEventCalls();
+
+    // External ports have no stream to read a position from
+    _useAudioClock = _clockSource == AudioClock && _midiPortNum == -1;
+    if (_useAudioClock)
+        _clockAnchorSample = lookahead ? anchorSample : _midiSynth->decodePosition();
+
     _eTimer->restart();
+    {
+        QMutexLocker locker(&_commandMutex);
+        _tempoChanged = false;
+        _tempoClock.reset(tempo_scale * 0.01);
+    }
 
-    for (int i = _playedIndex; i < _midi->events().size(); i++) {
+    // Notes held across the start position were silenced by the seek or
+    // the pause, sound them again before the next event
+    if (_playedIndex > 0 && _playedIndex < events.size()) {
+        if (lookahead)
+            _midiSynth->setEventPosition(anchorSample);
+        chaseNotes(events[_playedIndex]->tick());
+    }
+
+    bool interrupted = false;
+    for (int i = _playedIndex; i < events.size(); i++) {
 
-        if (!_playing)
+        if (hasPendingCommand()) {
+            interrupted = true;
             break;
+        }
 
-        _playingEventPtr = _midi->events()[i];
+        const MidiEvent *e = events[i];
+        _playingEventPtr = e;
 
-        if (_midi->events()[i]->eventType() != MidiEventType::Meta) {
+        if (batch && e->tick() != batchTick) {
+            _midiSynth->flushEvents();
+            batchTick = e->tick();
+        }
 
-            long eventTime = _midi->timeFromTick(_midi->events()[i]->tick()) * 1000;//* (tempo_scale * 0.01);
-            long waitTime = eventTime - _startPlayTime - _eTimer->elapsed();
-            if (waitTime > 0) {
-                msleep(waitTime);
+        if (e->eventType() != MidiEventType::Meta) {
+
+            long eventTime = _midi->eventMicroseconds(i) / 1000;
+            qint64 songUs = _midi->eventMicroseconds(i) - (qint64)_startPlayTime * 1000;
+            qint64 deadline = 0;
+            // A speed change wakes the wait, rebase and wait again for the
+            // moved deadline
+            forever {
+                deadline = _tempoClock.clockTime(songUs);
+                if (lookahead) {
+                    if (deadline - lookaheadUs <= _eTimer->nsecsElapsed() / 1000)
+                        break;
+                    _midiSynth->flushEvents();
+                    if (waitUntil(deadline - lookaheadUs / 2, false))
+                        break;
+                } else if (waitUntil(deadline)) {
+                    break;
+                }
+                if (hasPendingCommand()) {
+                    interrupted = true;
+                    break;
+                }
+                applyTempoScale();
             }
+            if (interrupted)
+                break;
+
+            if (lookahead)
+                _midiSynth->setEventPosition(anchorSample + deadline * _midiSynth->sampleRate() / 1000000);
+            else
+                addLateness(_eTimer->nsecsElapsed() / 1000 - deadline);
 
 //            qint32 waitTime;
 //            do {
@@ -473,20 +819,19 @@ void MidiPlayer::playEvents()
 //                }
 //            } while (waitTime > 0);
 
-            if (_midi->events()[i]->eventType() != MidiEventType::SysEx) {
+            if (e->eventType() != MidiEventType::SysEx) {
 
-//                if (_midi->events()[i]->eventType() == MidiEventType::Controller
-//                    || _midi->events()[i]->eventType() == MidiEventType::ProgramChange) {
-//                    sendEvent(_midi->events()[i]);
+//                if (e->eventType() == MidiEventType::Controller
+//                    || e->eventType() == MidiEventType::ProgramChange) {
+//                    sendEvent(e);
 //                } else {
-                    if (_midiChannels[_midi->events()[i]->channel()].isMute() == false) {
-                        if (_useSolo) {
-                            if (_midiChannels[_midi->events()[i]->channel()].isSolo()) {
-                                sendEvent(_midi->events()[i]);
-                            }
-                        } else {
-                            sendEvent(_midi->events()[i]);
-                        }
+                    // The internal synth plays the compiled song, program
+                    // changes depend on the locks and go through sendEvent()
+                    if (isChannelAudible(e->channel())) {
+                        if (_midiPortNum == -1 && e->eventType() != MidiEventType::ProgramChange)
+                            sendCompiledEvent(i, e);
+                        else
+                            sendEvent(e);
                     }
 //                }
 
@@ -495,28 +840,129 @@ void MidiPlayer::playEvents()
             _positionMs = eventTime;
 
         } else { // Meta event
-            if (_midi->events()[i]->metaEventType() == MidiMetaType::SetTempo) {
-                _midiBpm = _midi->events()[i]->tempoBpm();
-                emit bpmChanged(_midiBpm);
+            if (e->metaEventType() == MidiMetaType::SetTempo) {
+                _midiBpm = _midi->tempoBpm(e);
+                emit bpmChanged(qRound(_midiBpm * GetCurrentTempoScale()));
             }
         }
 
         _playedIndex = i;
-        _positionTick = _midi->events()[i]->tick();
+        _positionTick = e->tick();
 
-        emit playingEvents(_playingEventPtr);
+        feedEvent(_playingEventPtr);
 
     } // End for loop
 
-    sendAllNotesOff();
+    if (lookahead) {
+        // A stop drops what BASS has not played yet, the end of the song
+        // lets it play out and silences after the last event.
+        if (interrupted) {
+            _midiSynth->cancelEvents();
+        } else {
+            sendAllNotesOff();
+            _midiSynth->flushEvents();
+
+            // Let it play out before finishing, the next song must not
+            // start while it is still queued in the stream
+            QWORD end = _midiSynth->eventPosition();
+            qint64 giveUp = _eTimer->nsecsElapsed() / 1000 + 2 * lookaheadUs + 1000000;
+            while (_midiSynth->playPosition() < end && _eTimer->nsecsElapsed() / 1000 < giveUp) {
+                if (waitUntil(_eTimer->nsecsElapsed() / 1000 + 10000, false))
+                    continue;
+                if (hasPendingCommand()) {
+                    _midiSynth->cancelEvents();
+                    interrupted = true;
+                    break;
+                }
+                applyTempoScale();
+            }
+        }
+        _midiSynth->setQueueing(false);
+    }
+    if (batch) {
+        _midiSynth->flushEvents();
+        _midiSynth->setQueueing(false);
+    }
+
+    if (!lookahead || interrupted)
+        sendAllNotesOff();
+
+    if (_midiPortNum == -1 && _eTimer->elapsed() > 0)
+        _synthCallsPerSecond = (_midiSynth->streamEventCalls() - synthCalls) * 1000 / _eTimer->elapsed();
 
     // Check finished
-    if (_playedIndex == _midi->events().size() -1 ) {
+    if (!interrupted) {
+        _playing = false;
+        _stopped = true;
         _finished = true;
+        emit playbackFinished();
+    }
+}
+
+bool MidiPlayer::waitUntil(qint64 deadline, bool precise)
+{
+    // Block on the command queue for most of the wait, a command or a
+    // speed change ends it at once. Deadline mode leaves the last 2 ms to
+    // the fine sleep, unless the caller does not need it to the microsecond.
+    precise = precise && _schedulerMode == Deadline;
+    qint64 margin = precise ? 2000 + _spinMicroseconds : 0;
+    {
+        QMutexLocker locker(&_commandMutex);
+        forever {
+            if (!_commands.isEmpty() || _tempoChanged)
+                return false;
+            qint64 coarseMs = (deadline - margin - _eTimer->nsecsElapsed() / 1000) / 1000;
+            if (coarseMs <= 0)
+                break;
+            _commandCond.wait(&_commandMutex, coarseMs);
+        }
+    }
+
+    if (!precise)
+        return true;
+
+    // Sleep to just before the deadline, then spin the rest
+    qint64 sleepUs = deadline - _spinMicroseconds - _eTimer->nsecsElapsed() / 1000;
+    if (sleepUs > 0) {
+#ifdef Q_OS_LINUX
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += sleepUs / 1000000;
+        ts.tv_nsec += (sleepUs % 1000000) * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+#else
+        usleep(sleepUs);
+#endif
     }
+
+    while (_eTimer->nsecsElapsed() / 1000 < deadline) {}
+
+    return true;
+}
+
+QVector<int> MidiPlayer::latenessHistogram()
+{
+    QVector<int> h(8);
+    for (int i = 0; i < 8; i++)
+        h[i] = _lateness[i];
+    return h;
 }
 
-void MidiPlayer::sendEvent(MidiEvent *e)
+void MidiPlayer::addLateness(qint64 us)
+{
+    static const qint64 bounds[] = { 100, 250, 500, 1000, 2000, 5000, 10000 };
+
+    int i = 0;
+    while (i < 7 && us >= bounds[i])
+        i++;
+    _lateness[i]++;
+}
+
+void MidiPlayer::sendEvent(const MidiEvent *e)
 {
     int ch = e->channel();
 
@@ -549,13 +995,7 @@ void MidiPlayer::sendEvent(MidiEvent *e)
         break;
     }
     case MidiEventType::Controller: {
-        switch (e->data1()) {
-        case 7: _midiChannels[ch].setVolume(e->data2()); break;
-        case 10: _midiChannels[ch].setPan(e->data2()); break;
-        case 91: _midiChannels[ch].setReverb(e->data2()); break;
-        case 93: _midiChannels[ch].setChorus(e->data2()); break;
-        default: break;
-        }
+        setChannelController(ch, e->data1(), e->data2());
 
         if (_midiPortNum == -1) {
             _midiSynth->sendController(ch, e->data1(), e->data2());
@@ -612,6 +1052,108 @@ void MidiPlayer::sendEvent(MidiEvent *e)
 //    qDebug("%d",e->eventType());
 }
 
+void MidiPlayer::feedEvent(const MidiEvent *e)
+{
+    switch (e->eventType()) {
+    case MidiEventType::NoteOn:
+        if (e->data2() == 0)
+            return;
+        break;
+    case MidiEventType::Controller:
+    case MidiEventType::ProgramChange:
+        break;
+    default:
+        return;
+    }
+
+    // The ring takes one producer, the player thread. The drum and bass
+    // locks change programs from the UI thread, those wait in a list.
+    if (QThread::currentThread() == this)
+        _playedEvents.push(MidiEventRecord::fromEvent(e));
+    else
+        _callerEvents.append(MidiEventRecord::fromEvent(e));
+}
+
+int MidiPlayer::takePlayedEvents(MidiEventRecord *out, int max)
+{
+    int n = qMin(max, _callerEvents.size());
+    for (int i=0; i<n; i++)
+        out[i] = _callerEvents[i];
+    _callerEvents.remove(0, n);
+
+    return n + _playedEvents.pop(out + n, max - n);
+}
+
+void MidiPlayer::preloadSongPresets()
+{
+    if (!_midiSynth->isSongPresetsOnly())
+        return;
+
+    // Bank and program of each program change, as sendEvent() will play
+    // them. Channels playing notes before any program change use program 0.
+    std::set<std::pair<int, int>> presets;
+    int bank[16] = { 0 };
+    bool programSet[16] = { false };
+
+    for (const MidiEvent *e : _midi->events()) {
+        int ch = e->channel();
+        switch (e->eventType()) {
+        case MidiEventType::Controller:
+            if (e->data1() == 0)
+                bank[ch] = e->data2() & 0x7F;
+            break;
+        case MidiEventType::ProgramChange: {
+            int program = e->data1() & 0x7F;
+            programSet[ch] = true;
+            if (ch == 9) {
+                presets.insert(std::make_pair(128, _lockDrum ? _lockDrumNumber : program));
+                break;
+            }
+            if (_lockBass && isBassInstrument(program))
+                program = _lockBassBumber;
+            // Program changes also request bank 0, see MidiSynthesizer
+            presets.insert(std::make_pair(0, program));
+            if (bank[ch] > 0)
+                presets.insert(std::make_pair(bank[ch], program));
+            break;
+        }
+        case MidiEventType::NoteOn:
+            if (!programSet[ch]) {
+                programSet[ch] = true;
+                presets.insert(std::make_pair(ch == 9 ? 128 : 0, 0));
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    _midiSynth->preloadPresets(presets);
+}
+
+void MidiPlayer::sendCompiledEvent(int index, const MidiEvent *e)
+{
+    if (e->eventType() == MidiEventType::Controller)
+        setChannelController(e->channel(), e->data1(), e->data2());
+
+    uint32_t first = _synthProgram.first[index];
+    uint32_t last = _synthProgram.first[index + 1];
+    if (last > first)
+        _midiSynth->sendCompiled(&_synthProgram.events[first], last - first,
+                                 _midiTranspose, _lockSnare ? _lockSnareNumber : -1);
+}
+
+void MidiPlayer::setChannelController(int ch, int number, int value)
+{
+    switch (number) {
+    case 7: _midiChannels[ch].setVolume(value); break;
+    case 10: _midiChannels[ch].setPan(value); break;
+    case 91: _midiChannels[ch].setReverb(value); break;
+    case 93: _midiChannels[ch].setChorus(value); break;
+    default: break;
+    }
+}
+
 void MidiPlayer::sendAllNotesOff(int ch)
 {
     if (_midiPortNum == -1) {
@@ -679,5 +1221,25 @@ float MidiPlayer::GetCurrentTempoScale() const
 
 void MidiPlayer::SetCurrentTempoScale (float scale)
 {
-    tempo_scale = (int) (scale * 100);
+    int percent = qBound(50, qRound(scale * 100), 200);
+    {
+        QMutexLocker locker(&_commandMutex);
+        if (percent == tempo_scale)
+            return;
+        tempo_scale = percent;
+        _tempoChanged = true;
+        _commandCond.wakeAll();
+    }
+
+    emit bpmChanged(qRound(_midiBpm * percent * 0.01));
+}
+
+void MidiPlayer::applyTempoScale()
+{
+    QMutexLocker locker(&_commandMutex);
+    if (!_tempoChanged)
+        return;
+
+    _tempoChanged = false;
+    _tempoClock.rebase(_eTimer->nsecsElapsed() / 1000, tempo_scale * 0.01);
 }
@@ -5,21 +5,47 @@
 #include "MidiOut.h"
 #include "Channel.h"
 #include "MidiSynthesizer.h"
+#include "MidiSeekIndex.h"
+#include "MidiNoteIndex.h"
+#include "MidiTempoClock.h"
+#include "MidiEventRing.h"
 
 #include <QThread>
 #include <QElapsedTimer>
 #include <QMap>
+#include <QVector>
+#include <QQueue>
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <atomic>
 
 class MidiPlayer : public QThread
 {
     Q_OBJECT
 public:
+    enum SchedulerMode {
+        MillisecondSleep,   // msleep() to the next event
+        Deadline            // Sleep to an absolute deadline, then spin
+    };
+
+    enum ClockSource {
+        WallClock,          // Time since playback started
+        AudioClock          // Samples played by the synth stream
+    };
+
     explicit MidiPlayer(QObject *parent = 0);
     ~MidiPlayer();
 
     static std::vector<std::string> midiDevices();
     bool setMidiOut(int portNumer);
     bool load(std::string file, bool seekFileChunkID = false);
+    // Parsed song and beat map as bytes, for SongCache
+    void saveCache(std::vector<unsigned char> *out);
+    bool loadCache(const unsigned char *data, size_t size);
+    // play(), stop() and setPositionTick() are queued to the player thread
+    // and return once it has handled them
+    void play();
     void stop(bool resetPos = false);
     void setVolume(int v);
     void setVolume(int ch, int v);
@@ -30,6 +56,7 @@ public:
     void setReverb(int ch, int v);
     void setChorus(int ch, int v);
     void setPositionTick(int t);
+    void setPositionMs(long ms);
     void setTranspose(int t);
 
     MidiSynthesizer* midiSynthesizer() { return _midiSynth; }
@@ -69,6 +96,28 @@ public:
 
     static int getNumberBeatInBar(int numerator, int denominator);
 
+    SchedulerMode schedulerMode() { return _schedulerMode; }
+    void setSchedulerMode(SchedulerMode mode) { _schedulerMode = mode; }
+    int spinMicroseconds() { return _spinMicroseconds; }
+    void setSpinMicroseconds(int us) { _spinMicroseconds = qMax(0, us); }
+    // Events sent late by <0.1, <0.25, <0.5, <1, <2, <5, <10 and >=10 ms,
+    // since the song was loaded
+    QVector<int> latenessHistogram();
+    // BASS event calls per second of the last play, internal synth only
+    quint64 synthEventCallsPerSecond() { return _synthCallsPerSecond; }
+    // Internal synth only, 0 sends every event when it is due
+    int lookaheadMs() { return _lookaheadMs; }
+    void setLookaheadMs(int ms) { _lookaheadMs = qMax(0, ms); }
+    // Source of positionMs()/positionTick(), external ports always use
+    // the wall clock
+    ClockSource clockSource() { return _clockSource; }
+    void setClockSource(ClockSource source) { _clockSource = source; }
+
+    // Note ons, controllers and program changes sent since the last call,
+    // oldest first. For the UI thread, which should call it once a frame.
+    int takePlayedEvents(MidiEventRecord *out, int max);
+
+    // Playback speed, 0.5 to 2.0. Takes effect from the current position.
     float GetCurrentTempoScale() const;
     void SetCurrentTempoScale (float scale);
 
@@ -77,10 +126,16 @@ protected:
 
 signals:
     void loaded();
-    void playingEvents(MidiEvent *e);
+    void playbackFinished();
     void bpmChanged(int bpm);
 
 private:
+    enum CommandType { Play, Pause, Stop, Seek, Quit };
+    struct Command {
+        CommandType type;
+        int tick;
+    };
+
     MidiFile            *_midi;
     MidiOut             *_midiOut;
     MidiSynthesizer     *_midiSynth;
@@ -92,7 +147,10 @@ private:
     int                 _midiBeatCount = 0;
 
     MidiEvent   _tempEvent;
-    MidiEvent   *_playingEventPtr = nullptr;
+    const MidiEvent *_playingEventPtr = nullptr;
+
+    MidiEventRing           _playedEvents;      // Written by the player thread
+    QVector<MidiEventRecord> _callerEvents;     // Written by the UI thread
 
     int     _volume = 100;
     int     _durationTick = 0;
@@ -114,14 +172,55 @@ private:
     int     _lockSnareNumber = 38;
     int     _lockBassBumber  = 32;
 
-    float   tempo_scale;
+    int     tempo_scale = 100;      // Percent, guarded by _commandMutex
+    bool    _tempoChanged = false;
+    MidiTempoClock  _tempoClock;    // Player thread, others use tempoClock()
+
+    SchedulerMode   _schedulerMode = MillisecondSleep;
+    int             _spinMicroseconds = 300;
+    int             _lookaheadMs = 0;
+    ClockSource     _clockSource = WallClock;
+    bool            _useAudioClock = false;
+    QWORD           _clockAnchorSample = 0;
+    std::atomic<int> _lateness[8];  // Player thread counts, GUI reads
+    std::atomic<quint64> _synthCallsPerSecond{0};
+
+    MidiSeekIndex   _seekIndex;
+    MidiNoteIndex   _noteIndex;
+    MidiSynthProgram _synthProgram;
+    std::vector<const MidiNoteInterval*> _chasedNotes;
 
     // number beat in 1 bar , number bar
     QMap<int, int> _beatInBar;
     QElapsedTimer *_eTimer;
 
+    QQueue<Command> _commands;
+    QMutex          _commandMutex;
+    QWaitCondition  _commandCond;
+    QWaitCondition  _commandDoneCond;
+    quint64         _commandsPosted = 0;
+    quint64         _commandsDone = 0;
+
+    void postCommand(CommandType type, int tick = 0);
+    bool hasPendingCommand();
+    void startPlaying();
+    void seek(int t);
+    void sendChannelState(const MidiChannelState &state);
+    void chaseNotes(uint32_t tick);
+    bool isChannelAudible(int ch);
+
+    void songLoaded();
+    void preloadSongPresets();
     void playEvents();
-    void sendEvent(MidiEvent *e);
+    bool waitUntil(qint64 deadline, bool precise = true);
+    void applyTempoScale();
+    MidiTempoClock tempoClock();
+    qint64 playedMicroseconds();
+    void addLateness(qint64 us);
+    void sendEvent(const MidiEvent *e);
+    void feedEvent(const MidiEvent *e);
+    void sendCompiledEvent(int index, const MidiEvent *e);
+    void setChannelController(int ch, int number, int value);
     void sendAllNotesOff(int ch);
     void sendAllNotesOff();
     void sendResetAllControllers();
@@ -0,0 +1,130 @@
+#include "MidiSeekIndex.h"
+
+#include <algorithm>
+#include <cstring>
+
+void MidiChannelState::clear()
+{
+    memset(controller, 0xFF, sizeof(controller));
+    memset(program, 0xFF, sizeof(program));
+    memset(pitchBend, 0xFF, sizeof(pitchBend));
+    memset(rpnMsb, 0xFF, sizeof(rpnMsb));
+    memset(rpnLsb, 0xFF, sizeof(rpnLsb));
+    memset(nrpnSelected, 0, sizeof(nrpnSelected));
+}
+
+void MidiChannelState::apply(const MidiEvent *e)
+{
+    int ch = e->channel();
+
+    switch (e->eventType()) {
+    case MidiEventType::ProgramChange:
+        program[ch] = e->data1() & 0x7F;
+        break;
+    case MidiEventType::PitchBend:
+        pitchBend[ch] = e->data1() & 0x3FFF;
+        break;
+    case MidiEventType::Controller: {
+        int number = e->data1() & 0x7F;
+        uint8_t value = e->data2() & 0x7F;
+        uint8_t *cc = controller[ch];
+
+        switch (number) {
+        case 6:
+        case 38: {
+            cc[number] = value;
+            // Also keep it per parameter when an RPN 0-2 is selected
+            if (!nrpnSelected[ch] && cc[101] == 0 && cc[100] < 3) {
+                if (number == 6)
+                    rpnMsb[ch][cc[100]] = value;
+                else
+                    rpnLsb[ch][cc[100]] = value;
+            }
+            break;
+        }
+        case 98:
+        case 99:
+        case 100:
+        case 101:
+            // Data entry sent before a new selector belongs to the old one
+            cc[number] = value;
+            cc[6] = cc[38] = 0xFF;
+            nrpnSelected[ch] = number < 100;
+            break;
+        case 121:
+            // Reset all controllers (RP-015), volume, pan and bank stay
+            cc[1] = cc[11] = 0xFF;
+            memset(cc + 64, 0xFF, 6);
+            cc[6] = cc[38] = 0xFF;
+            cc[98] = cc[99] = cc[100] = cc[101] = 0xFF;
+            pitchBend[ch] = 0xFFFF;
+            break;
+        default:
+            // 120-127 are channel mode messages, not state
+            if (number < 120)
+                cc[number] = value;
+            break;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void MidiSeekIndex::build(MidiEventSpan events, uint32_t interval)
+{
+    clear();
+    if (interval == 0)
+        interval = 1;
+
+    MidiChannelState state;
+    state.clear();
+
+    // Intervals without events get no checkpoint of their own
+    uint32_t nextTick = 0;
+    for (size_t i=0; i<events.size(); i++) {
+        const MidiEvent *e = events[i];
+        if (e->tick() >= nextTick) {
+            Checkpoint c;
+            c.tick = e->tick() - e->tick() % interval;
+            c.eventIndex = i;
+            c.state = state;
+            fCheckpoints.push_back(c);
+            nextTick = c.tick + interval;
+            if (nextTick < c.tick)
+                nextTick = UINT32_MAX;
+        }
+        state.apply(e);
+    }
+}
+
+void MidiSeekIndex::clear()
+{
+    fCheckpoints.clear();
+    fCheckpoints.shrink_to_fit();
+}
+
+int MidiSeekIndex::stateAt(MidiEventSpan events, uint32_t tick, MidiChannelState *state) const
+{
+    auto it = std::upper_bound(fCheckpoints.begin(), fCheckpoints.end(), tick,
+                               [](uint32_t t, const Checkpoint &c) { return t < c.tick; });
+
+    size_t index = 0;
+    if (it == fCheckpoints.begin()) {
+        state->clear();
+    } else {
+        --it;
+        *state = it->state;
+        index = it->eventIndex;
+    }
+
+    for (; index < events.size(); index++) {
+        const MidiEvent *e = events[index];
+        if (e->tick() > tick)
+            break;
+        state->apply(e);
+    }
+
+    return index;
+}
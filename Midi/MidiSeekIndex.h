@@ -0,0 +1,61 @@
+#ifndef MIDISEEKINDEX_H
+#define MIDISEEKINDEX_H
+
+#include "MidiFile.h"
+
+#include <cstdint>
+#include <vector>
+
+/*
+    Controller, program and pitch bend state of the 16 channels.
+
+        Values not set by the song are 0xFF (0xFFFF for 14 bit values).
+        Data entry of RPN 0-2 (bend range, fine and coarse tune) is kept
+        per parameter, since a seek has to restore all of them and not only
+        the last one selected.
+*/
+
+struct MidiChannelState {
+    uint8_t  controller[16][128];
+    uint8_t  program[16];
+    uint16_t pitchBend[16];
+    uint8_t  rpnMsb[16][3];
+    uint8_t  rpnLsb[16][3];
+    bool     nrpnSelected[16];  // Last selector written was NRPN (98/99)
+
+    void clear();
+    void apply(const MidiEvent *e);
+};
+
+/*
+    Channel state checkpoints for seeking.
+
+        build() walks the song once and stores the state every interval
+        ticks. stateAt() binary searches the last checkpoint at or before
+        a tick and replays only the channel events after it.
+*/
+
+class MidiSeekIndex
+{
+public:
+    void build(MidiEventSpan events, uint32_t interval);
+    void clear();
+
+    size_t checkpointCount() { return fCheckpoints.size(); }
+
+    // State after every event at or before tick, returns the index of the
+    // first event after tick
+    int stateAt(MidiEventSpan events, uint32_t tick, MidiChannelState *state) const;
+
+private:
+    // State before the first event at or after tick, which is eventIndex
+    struct Checkpoint {
+        uint32_t tick;
+        int eventIndex;
+        MidiChannelState state;
+    };
+
+    std::vector<Checkpoint> fCheckpoints;
+};
+
+#endif // MIDISEEKINDEX_H
@@ -0,0 +1,90 @@
+#include "MidiSoundfontPool.h"
+
+#include <QFileInfo>
+#include <QDateTime>
+
+std::mutex MidiSoundfontPool::mutex;
+std::vector<MidiSoundfontPool::Entry> MidiSoundfontPool::entries;
+
+static int64_t modifiedTime(const std::string &sfile)
+{
+    QFileInfo fi(QString::fromStdString(sfile));
+    return fi.exists() ? fi.lastModified().toMSecsSinceEpoch() : -1;
+}
+
+HSOUNDFONT MidiSoundfontPool::acquire(const std::string &sfile)
+{
+    int64_t modified = modifiedTime(sfile);
+    if (modified < 0)
+        return 0;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (Entry &e : entries) {
+            if (e.file == sfile && e.modified == modified) {
+                e.users++;
+                return e.font;
+            }
+        }
+    }
+
+    // Opened without the lock, fonts load in parallel
+    HSOUNDFONT font = BASS_MIDI_FontInit(sfile.data(), BASS_MIDI_FONT_MMAP);
+    if (!font)
+        return 0;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (Entry &e : entries) {
+        if (e.file == sfile && e.modified == modified) {
+            // Opened by another thread meanwhile
+            BASS_MIDI_FontFree(font);
+            e.users++;
+            return e.font;
+        }
+    }
+
+    // An unused handle of an older version of the file is stale
+    for (auto it = entries.begin(); it != entries.end(); ) {
+        if (it->file == sfile && it->users == 0) {
+            BASS_MIDI_FontFree(it->font);
+            it = entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    entries.push_back({ sfile, modified, font, 1 });
+
+    return font;
+}
+
+void MidiSoundfontPool::release(HSOUNDFONT font)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (Entry &e : entries) {
+        if (e.font == font) {
+            if (e.users > 0)
+                e.users--;
+            return;
+        }
+    }
+}
+
+void MidiSoundfontPool::trim()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = entries.begin(); it != entries.end(); ) {
+        if (it->users == 0) {
+            BASS_MIDI_FontFree(it->font);
+            it = entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+size_t MidiSoundfontPool::size()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size();
+}
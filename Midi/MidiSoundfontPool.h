@@ -0,0 +1,42 @@
+#ifndef MIDISOUNDFONTPOOL_H
+#define MIDISOUNDFONTPOOL_H
+
+#include <bassmidi.h>
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+    Soundfont handles opened by the process, by file path and mtime.
+
+        A font released by its last user stays open with its samples, so
+        reopening the synth or setting the same files again does not read
+        them from disk. trim() frees the fonts nobody uses.
+*/
+
+class MidiSoundfontPool
+{
+public:
+    // An initialized font of the file, 0 when it can not be opened.
+    // Each acquire() needs a release().
+    static HSOUNDFONT acquire(const std::string &sfile);
+    static void release(HSOUNDFONT font);
+    static void trim();
+
+    static size_t size();
+
+private:
+    struct Entry {
+        std::string file;
+        int64_t     modified;
+        HSOUNDFONT  font;
+        int         users;
+    };
+
+    static std::mutex mutex;
+    static std::vector<Entry> entries;
+};
+
+#endif // MIDISOUNDFONTPOOL_H
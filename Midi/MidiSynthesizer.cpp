@@ -1,14 +1,18 @@
 #include "MidiSynthesizer.h"
+#include "MidiSoundfontPool.h"
 #include "SettingsDialog.h"
 
 #include <thread>
+#include <algorithm>
 #include <QDebug>
+#include <QElapsedTimer>
 
 MidiSynthesizer::MidiSynthesizer()
 {
     for (int i=0; i<129; i++) {
         intmSf.push_back(0);
     }
+    remapTo = intmSf;
 
     eq = new Equalizer24BandFX(0);
     reverb = new ReverbFX(0);
@@ -32,15 +36,25 @@ MidiSynthesizer::MidiSynthesizer()
     for (int i=0; i<16; i++)
     {
         chInstType[i] = InstrumentType::Piano;
+        channelPresets[i] = std::make_pair(i == 9 ? 128 : 0, 0);
     }
     chInstType[9] = InstrumentType::PercussionEtc;
 }
 
 MidiSynthesizer::~MidiSynthesizer()
 {
+    stopPresetThread();
+
     if (openned)
         close();
 
+    {
+        std::unique_lock<std::mutex> fontLock(fontMutex);
+        fontLoadersDone.wait(fontLock, [this] { return fontLoaders == 0; });
+    }
+    MidiSoundfontPool::trim();
+    BASS_Free();
+
     // Fx ------------
     delete eq;
     delete reverb;
@@ -64,12 +78,22 @@ bool MidiSynthesizer::open()
     settings = new QSettings();
 
     BASS_SetConfig(BASS_CONFIG_DEV_DEFAULT, 1);
-    BASS_Init(outDev, 44100, BASS_DEVICE_LATENCY|BASS_DEVICE_FREQ, NULL, NULL);
+    initDevice(outDev);
     BASS_SetConfig(BASS_CONFIG_BUFFER, 300);
 
     flags = BASS_SAMPLE_FLOAT|BASS_MIDI_SINCINTER|BASS_MIDI_DECAYSEEK|BASS_MIDI_DECAYEND;
     stream = BASS_MIDI_StreamCreate(32, flags, 0);
 
+    BASS_CHANNELINFO info;
+    if (BASS_ChannelGetInfo(stream, &info)) {
+        streamRate = info.freq;
+        streamFrameSize = info.chans * sizeof(float);
+    }
+
+    // Measured because of BASS_DEVICE_LATENCY
+    BASS_INFO devInfo;
+    deviceLatency = BASS_GetInfo(&devInfo) ? devInfo.latency : 0;
+
     #ifdef _WIN32
         BASS_SetConfig(BASS_CONFIG_UPDATEPERIOD, 20);
     #else
@@ -82,6 +106,12 @@ bool MidiSynthesizer::open()
     float nVoices = (concurentThreadsSupported > 1) ? 500 : 256;
     BASS_ChannelSetAttribute(stream, BASS_ATTRIB_MIDI_VOICES, nVoices);
 
+    // Before the loaders start, a font ready early must find the stream
+    // open to join it
+    {
+        std::lock_guard<std::mutex> fontLock(fontMutex);
+        openned = true;
+    }
     setSfToStream();
 
     for (int sfInex : intmSf) {
@@ -103,7 +133,6 @@ bool MidiSynthesizer::open()
     reverb->setStreamHandle(stream);
     chorus->setStreamHandle(stream);
 
-    openned = true;
     return true;
 }
 
@@ -119,14 +148,25 @@ void MidiSynthesizer::close()
 
 
     BASS_ChannelStop(stream);
+    stopPresetThread();
 
-    for (HSOUNDFONT f : synth_HSOUNDFONT)
-        BASS_MIDI_FontFree(f);
-
-    synth_HSOUNDFONT.clear();
+    {
+        std::lock_guard<std::mutex> fontLock(fontMutex);
+        // Loaders still running are left to finish on their own, what they
+        // load stays in the pool. Fonts stay there for the next open() too.
+        fontGeneration++;
+        fontsLoading = 0;
+        releaseFontsLocked();
+
+        synth_HSOUNDFONT.clear();
+        fontReady.clear();
+
+        std::lock_guard<std::mutex> lock(presetMutex);
+        pinnedPresets.clear();
+    }
 
+    // BASS stays initialized, see setOutputDevice()
     BASS_StreamFree(stream);
-    BASS_Free();
 
     openned = false;
 }
@@ -138,10 +178,40 @@ int MidiSynthesizer::outPutDevice()
 
 bool MidiSynthesizer::setOutputDevice(int dv)
 {
+    int oldDev = outDev;
     outDev = dv;
 
-    if (openned)
-        return BASS_SetDevice(dv);
+    if (!openned)
+        return true;
+
+    // The stream moves with its fonts and state, devices used before
+    // stay initialized for switching back
+    int device = initDevice(dv);
+    if (device < 0 || !BASS_ChannelSetDevice(stream, device)) {
+        outDev = oldDev;
+        initDevice(oldDev);
+        return false;
+    }
+
+    BASS_INFO devInfo;
+    deviceLatency = BASS_GetInfo(&devInfo) ? devInfo.latency : 0;
+
+    return true;
+}
+
+int MidiSynthesizer::initDevice(int dv)
+{
+    if (BASS_Init(dv, 44100, BASS_DEVICE_LATENCY|BASS_DEVICE_FREQ, NULL, NULL))
+        return BASS_GetDevice();
+
+    if (BASS_ErrorGetCode() != BASS_ERROR_ALREADY)
+        return -1;
+
+    // With BASS_CONFIG_DEV_DEFAULT the default device is device 1
+    if (dv == -1)
+        dv = 1;
+
+    return BASS_SetDevice(dv) ? dv : -1;
 }
 
 void MidiSynthesizer::setSoundFonts(std::vector<std::string> &soundfonsFiles)
@@ -162,80 +232,119 @@ void MidiSynthesizer::setVolume(float vol)
 
 float MidiSynthesizer::soundfontVolume(int sfIndex)
 {
-    if (sfIndex < 0 || sfIndex >= synth_HSOUNDFONT.size())
+    std::lock_guard<std::mutex> fontLock(fontMutex);
+    if (sfIndex < 0 || sfIndex >= fontVolumes.size())
         return -1;
 
-    return BASS_MIDI_FontGetVolume(synth_HSOUNDFONT[sfIndex]);
+    return fontVolumes[sfIndex];
 }
 
 void MidiSynthesizer::setSoundfontVolume(int sfIndex, float sfvl)
 {
-    if (sfIndex < 0 || sfIndex >= synth_HSOUNDFONT.size())
+    std::lock_guard<std::mutex> fontLock(fontMutex);
+    if (sfIndex < 0 || sfIndex >= fontVolumes.size())
         return;
 
-    BASS_MIDI_FontSetVolume(synth_HSOUNDFONT[sfIndex], sfvl);
+    // Fonts still loading get it when ready
+    fontVolumes[sfIndex] = sfvl;
+    if (synth_HSOUNDFONT[sfIndex])
+        BASS_MIDI_FontSetVolume(synth_HSOUNDFONT[sfIndex], sfvl);
 }
 
 bool MidiSynthesizer::setMapSoundfontIndex(const std::vector<int> &intrumentSfIndex)
 {
-    intmSf.clear();
-    intmSf = intrumentSfIndex;
-
-    if (intrumentSfIndex.size() < 129 || synth_HSOUNDFONT.size() == 0 || !openned)
+    if (intrumentSfIndex.size() < 129 || !openned) {
+        std::lock_guard<std::mutex> fontLock(fontMutex);
+        intmSf = intrumentSfIndex;
+        std::lock_guard<std::mutex> lock(presetMutex);
+        remapTo = intrumentSfIndex;
         return false;
+    }
 
+    // The preset thread loads the samples and switches the map after the
+    // presets already queued, a newer map replaces one still waiting
+    std::lock_guard<std::mutex> lock(presetMutex);
+    remapTo = intrumentSfIndex;
+    remapPending = true;
+    wakePresetThreadLocked();
 
-    std::vector<BASS_MIDI_FONTEX> mFonts;
-
-    // check use another sf
-    for (int i=0; i<129; i++) {
+    return true;
+}
 
-        if (intmSf.at(i) <= 0)
-            continue;
+std::vector<int> MidiSynthesizer::getMapSoundfontIndex()
+{
+    std::lock_guard<std::mutex> lock(presetMutex);
+    return remapTo;
+}
 
-        if (intmSf.at(i) >= synth_HSOUNDFONT.size())
-            continue;
+void MidiSynthesizer::applyMapSoundfontIndex(const std::vector<int> &intrumentSfIndex)
+{
+    QElapsedTimer timer;
+    timer.start();
 
-        BASS_MIDI_FONTEX font;
-        font.font = synth_HSOUNDFONT.at(intmSf.at(i));
+    std::lock_guard<std::mutex> fontLock(fontMutex);
 
-        if (i < 128) {
-            font.spreset = i;
-            font.sbank = 0;
-            font.dpreset = i;
-            font.dbank = 0;
-            font.dbanklsb = 0;
-        }
-        else {
-            font.spreset = -1;
-            font.sbank = 128;
-            font.dpreset = -1;
-            font.dbank = 128;
-            font.dbanklsb = 0;
-        }
+    std::vector<int> oldMap = intmSf;
+    intmSf = intrumentSfIndex;
 
-        mFonts.push_back(font);
-    }
+    if (synth_HSOUNDFONT.size() == 0 || !openned)
+        return;
 
-    // defaut sf
-    BASS_MIDI_FONTEX f;
-    f.font = synth_HSOUNDFONT.at(0);
-    f.spreset = -1;
-    f.sbank = -1;
-    f.dpreset = -1;
-    f.dbank = 0;
-    f.dbanklsb = 0;
+    // The font that plays an entry, the default one when its font is
+    // not ready, -1 while that one is not ready either
+    int def = fontReady[0] ? 0 : -1;
+    auto playingFont = [this, def](const std::vector<int> &map, int i) {
+        int sf = i < (int)map.size() ? map[i] : 0;
+        return sf > 0 && sf < (int)fontReady.size() && fontReady[sf] ? sf : def;
+    };
 
-    mFonts.push_back(f);
+    std::vector<bool> changed(129, false);
+    int changes = 0;
+    for (int i=0; i<129; i++) {
+        changed[i] = playingFont(oldMap, i) != playingFont(intmSf, i);
+        changes += changed[i];
+    }
+    if (changes == 0)
+        return;
 
+    // Only samples of the changed entries load, from their new font and
+    // before the switch, so nothing playing waits on them
+    std::vector<std::pair<std::pair<int, int>, LoadedPreset>> moved;
+    if (songPresetsOnly) {
+        {
+            std::lock_guard<std::mutex> lock(presetMutex);
+            for (auto it = loadedPresets.begin(); it != loadedPresets.end(); ) {
+                if (changed[it->first.first == 128 ? 128 : it->first.second]) {
+                    moved.push_back(*it);
+                    it = loadedPresets.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        for (const auto &p : moved)
+            loadPresetLocked(p.first.first, p.first.second);
+    } else {
+        for (int i=0; i<129; i++) {
+            if (!changed[i] || playingFont(intmSf, i) < 0)
+                continue;
+            HSOUNDFONT f = synth_HSOUNDFONT[playingFont(intmSf, i)];
+            if (i < 128)
+                BASS_MIDI_FontLoad(f, i, 0);
+            else
+                BASS_MIDI_FontLoad(f, -1, 128);
+        }
+    }
 
-    // set to stream
-    BASS_MIDI_StreamSetFonts(0, mFonts.data(), mFonts.size());
-    BASS_MIDI_StreamSetFonts(stream, mFonts.data(), mFonts.size());
+    setStreamFontsLocked();
 
-    BASS_MIDI_StreamLoadSamples(stream);
+    // Moved presets are no longer played from their old font
+    for (const auto &p : moved)
+        BASS_MIDI_FontUnload(p.second.font, p.first.second, p.second.bank);
+    if (!moved.empty())
+        residentBytes = loadedSampleBytesLocked();
 
-    return true;
+    remapUs = timer.nsecsElapsed() / 1000;
 }
 
 void MidiSynthesizer::sendNoteOff(int ch, int note, int velocity)
@@ -244,9 +353,9 @@ void MidiSynthesizer::sendNoteOff(int ch, int note, int velocity)
         return;
 
     if (ch == 9)
-        BASS_MIDI_StreamEvent(stream, getDrumChannelFromNote(note), MIDI_EVENT_NOTE, MAKEWORD(note, 0));
+        streamEvent(getDrumChannelFromNote(note), MIDI_EVENT_NOTE, MAKEWORD(note, 0));
     else
-        BASS_MIDI_StreamEvent(stream, ch, MIDI_EVENT_NOTE, MAKEWORD(note, 0));
+        streamEvent(ch, MIDI_EVENT_NOTE, MAKEWORD(note, 0));
 }
 
 void MidiSynthesizer::sendNoteOn(int ch, int note, int velocity)
@@ -255,9 +364,9 @@ void MidiSynthesizer::sendNoteOn(int ch, int note, int velocity)
         return;
 
     if (ch == 9)
-        BASS_MIDI_StreamEvent(stream, getDrumChannelFromNote(note), MIDI_EVENT_NOTE, MAKEWORD(note, velocity));
+        streamEvent(getDrumChannelFromNote(note), MIDI_EVENT_NOTE, MAKEWORD(note, velocity));
     else
-        BASS_MIDI_StreamEvent(stream, ch, MIDI_EVENT_NOTE, MAKEWORD(note, velocity));
+        streamEvent(ch, MIDI_EVENT_NOTE, MAKEWORD(note, velocity));
 }
 
 void MidiSynthesizer::sendNoteAftertouch(int ch, int note, int value)
@@ -266,95 +375,51 @@ void MidiSynthesizer::sendNoteAftertouch(int ch, int note, int value)
         return;
 
     if (ch == 9)
-        BASS_MIDI_StreamEvent(stream, getDrumChannelFromNote(note), MIDI_EVENT_KEYPRES, MAKEWORD(note, value));
+        streamEvent(getDrumChannelFromNote(note), MIDI_EVENT_KEYPRES, MAKEWORD(note, value));
     else
-        BASS_MIDI_StreamEvent(stream, ch, MIDI_EVENT_KEYPRES, MAKEWORD(note, value));
+        streamEvent(ch, MIDI_EVENT_KEYPRES, MAKEWORD(note, value));
 }
 
 void MidiSynthesizer::sendController(int ch, int number, int value)
 {
-    DWORD et;
-
-    switch (number) {
-    case 0:
-        et = MIDI_EVENT_BANK; break;
-    case 1:
-        et = MIDI_EVENT_MODULATION; break;
-    case 5:
-        et = MIDI_EVENT_PORTATIME; break;
-    case 7:
-        et = MIDI_EVENT_VOLUME; break;
-    case 10:
-        et = MIDI_EVENT_PAN; break;
-    case 11:
-        et = MIDI_EVENT_EXPRESSION; break;
-    case 32:
-        et = MIDI_EVENT_BANK_LSB; break;
-    case 64:
-        et = MIDI_EVENT_SUSTAIN; break;
-    case 65:
-        et = MIDI_EVENT_PORTAMENTO; break;
-    case 66:
-        et = MIDI_EVENT_SOSTENUTO; break;
-    case 67:
-        et = MIDI_EVENT_SOFT; break;
-    case 71:
-        et = MIDI_EVENT_RESONANCE; break;
-    case 72:
-        et = MIDI_EVENT_RELEASE; break;
-    case 73:
-        et = MIDI_EVENT_ATTACK; break;
-    case 74:
-        et = MIDI_EVENT_CUTOFF; break;
-    case 75:
-        et = MIDI_EVENT_DECAY; break;
-    case 84:
-        et = MIDI_EVENT_PORTANOTE; break;
-    case 91:
-        et = MIDI_EVENT_REVERB; break;
-    case 93:
-        et = MIDI_EVENT_CHORUS; break;
-    case 94:
-        et = MIDI_EVENT_USERFX; break;
-    case 120:
-        et = MIDI_EVENT_SOUNDOFF; break;
-    case 121:
-        et = MIDI_EVENT_RESET; break;
-    case 123:
-        et = MIDI_EVENT_NOTESOFF; break;
-    case 126:
-    case 127:
-        et = MIDI_EVENT_MODE; break;
-    default:
+    DWORD et = controllerEvent(number);
+    if (et == 0)
         return;
-        break;
-    }
 
     if (ch == 9) {
         for (int i=16; i<32; i++) {
-            BASS_MIDI_StreamEvent(stream, i, et, value);
+            streamEvent(i, et, value);
         }
     }
     else
-        BASS_MIDI_StreamEvent(stream, ch, et, value);
+        streamEvent(ch, et, value);
 }
 
 void MidiSynthesizer::sendProgramChange(int ch, int number)
 {
+    if (songPresetsOnly && ch >= 0 && ch < 16) {
+        std::pair<int, int> p(ch == 9 ? 128 : 0, number);
+        {
+            std::lock_guard<std::mutex> lock(presetMutex);
+            channelPresets[ch] = p;
+        }
+        requestPreset(p.first, p.second);
+    }
+
     if (ch == 9) {
         for (int i=16; i<32; i++) {
-            BASS_MIDI_StreamEvent(stream, i, MIDI_EVENT_PROGRAM, number);
+            streamEvent(i, MIDI_EVENT_PROGRAM, number);
         }
     }
     else {
         InstrumentType t = MidiHelper::getInstrumentType(number);
         chInstType[ch] = t;
-        BASS_MIDI_StreamEvent(stream, ch, MIDI_EVENT_PROGRAM, number);
+        streamEvent(ch, MIDI_EVENT_PROGRAM, number);
 
         if (instMap[t].enable)
-            BASS_MIDI_StreamEvent(stream, ch, MIDI_EVENT_MIXLEVEL, instMap[t].mixlevel);
+            streamEvent(ch, MIDI_EVENT_MIXLEVEL, instMap[t].mixlevel);
         else
-            BASS_MIDI_StreamEvent(stream, ch, MIDI_EVENT_MIXLEVEL, 0);
+            streamEvent(ch, MIDI_EVENT_MIXLEVEL, 0);
     }
 }
 
@@ -362,33 +427,33 @@ void MidiSynthesizer::sendChannelAftertouch(int ch, int value)
 {
     if (ch == 9) {
         for (int i=16; i<32; i++) {
-            BASS_MIDI_StreamEvent(stream, i, MIDI_EVENT_CHANPRES, value);
+            streamEvent(i, MIDI_EVENT_CHANPRES, value);
         }
     }
     else
-        BASS_MIDI_StreamEvent(stream, ch, MIDI_EVENT_CHANPRES, value);
+        streamEvent(ch, MIDI_EVENT_CHANPRES, value);
 }
 
 void MidiSynthesizer::sendPitchBend(int ch, int value)
 {
     if (ch == 9) {
         for (int i=16; i<32; i++) {
-            BASS_MIDI_StreamEvent(stream, i, MIDI_EVENT_PITCH, value);
+            streamEvent(i, MIDI_EVENT_PITCH, value);
         }
     }
     else
-        BASS_MIDI_StreamEvent(stream, ch, MIDI_EVENT_PITCH, value);
+        streamEvent(ch, MIDI_EVENT_PITCH, value);
 }
 
 void MidiSynthesizer::sendAllNotesOff(int ch)
 {
     if (ch == 9) {
         for (int i=16; i<32; i++) {
-            BASS_MIDI_StreamEvent(stream, i, MIDI_EVENT_NOTESOFF, 0);
+            streamEvent(i, MIDI_EVENT_NOTESOFF, 0);
         }
     }
     else
-        BASS_MIDI_StreamEvent(stream, ch, MIDI_EVENT_NOTESOFF, 0);
+        streamEvent(ch, MIDI_EVENT_NOTESOFF, 0);
 }
 
 void MidiSynthesizer::sendAllNotesOff()
@@ -402,11 +467,11 @@ void MidiSynthesizer::sendResetAllControllers(int ch)
 {
     if (ch == 9) {
         for (int i=16; i<32; i++) {
-            BASS_MIDI_StreamEvent(stream, i, MIDI_EVENT_RESET, 0);
+            streamEvent(i, MIDI_EVENT_RESET, 0);
         }
     }
     else
-        BASS_MIDI_StreamEvent(stream, ch, MIDI_EVENT_RESET, 0);
+        streamEvent(ch, MIDI_EVENT_RESET, 0);
 }
 
 void MidiSynthesizer::sendResetAllControllers()
@@ -416,6 +481,175 @@ void MidiSynthesizer::sendResetAllControllers()
     }
 }
 
+void MidiSynthesizer::compile(MidiEventSpan events, MidiSynthProgram *program)
+{
+    program->clear();
+    program->first.reserve(events.size() + 1);
+    program->events.reserve(events.size());
+
+    auto add = [program](int ch, DWORD event, DWORD param) {
+        BASS_MIDI_EVENT e = { event, param, (DWORD)ch, 0, 0 };
+        program->events.push_back(e);
+    };
+    // Drum channel events other than notes go to all the drum channels
+    auto addToChannel = [&add](int ch, DWORD event, DWORD param) {
+        if (ch == 9) {
+            for (int i=16; i<32; i++)
+                add(i, event, param);
+        } else {
+            add(ch, event, param);
+        }
+    };
+
+    for (const MidiEvent *e : events) {
+        program->first.push_back(program->events.size());
+
+        int ch = e->channel();
+        switch (e->eventType()) {
+        case MidiEventType::NoteOff:
+        case MidiEventType::NoteOn:
+        case MidiEventType::NoteAftertouch: {
+            int note = e->data1();
+            if (note > 127)
+                break;
+            DWORD et = e->eventType() == MidiEventType::NoteAftertouch ? MIDI_EVENT_KEYPRES : MIDI_EVENT_NOTE;
+            int value = e->eventType() == MidiEventType::NoteOff ? 0 : e->data2();
+            add(ch == 9 ? getDrumChannelFromNote(note) : ch, et, MAKEWORD(note, value));
+            break;
+        }
+        case MidiEventType::Controller: {
+            DWORD et = controllerEvent(e->data1());
+            if (et != 0)
+                addToChannel(ch, et, e->data2());
+            break;
+        }
+        case MidiEventType::ChannelAftertouch:
+            addToChannel(ch, MIDI_EVENT_CHANPRES, e->data1());
+            break;
+        case MidiEventType::PitchBend:
+            addToChannel(ch, MIDI_EVENT_PITCH, e->data1());
+            break;
+        default:
+            break;
+        }
+    }
+    program->first.push_back(program->events.size());
+}
+
+void MidiSynthesizer::sendCompiled(const BASS_MIDI_EVENT *events, int count, int transpose, int snareNote)
+{
+    bool queue = queueing && std::this_thread::get_id() == queueThread;
+
+    BASS_MIDI_EVENT buffer[16];
+    int n = 0;
+    for (int i=0; i<count; i++) {
+        BASS_MIDI_EVENT e = events[i];
+        if (e.event == MIDI_EVENT_NOTE || e.event == MIDI_EVENT_KEYPRES) {
+            int note = e.param & 0xFF;
+            if (e.chan < 16)
+                note += transpose;
+            else if (snareNote != -1 && (note == 38 || note == 40))
+                note = snareNote;
+            if (note < 0 || note > 127)
+                continue;
+            e.param = MAKEWORD(note, e.param >> 8);
+        }
+
+        if (queue) {
+            e.pos = eventPos;
+            pendingEvents.push_back(e);
+            continue;
+        }
+
+        buffer[n++] = e;
+        if (n == 16) {
+            streamCalls++;
+            BASS_MIDI_StreamEvents(stream, BASS_MIDI_EVENTS_STRUCT, buffer, n);
+            n = 0;
+        }
+    }
+
+    if (n > 0) {
+        streamCalls++;
+        BASS_MIDI_StreamEvents(stream, BASS_MIDI_EVENTS_STRUCT, buffer, n);
+    }
+}
+
+void MidiSynthesizer::setQueueing(bool q, bool timed)
+{
+    // The thread is published before queueing turns on
+    queueTimed = timed;
+    queueThread = std::this_thread::get_id();
+    queueing = q;
+}
+
+QWORD MidiSynthesizer::decodePosition()
+{
+    QWORD pos = BASS_ChannelGetPosition(stream, BASS_POS_BYTE|BASS_POS_DECODE);
+    if (pos == (QWORD)-1)
+        return 0;
+
+    return pos / streamFrameSize;
+}
+
+QWORD MidiSynthesizer::playPosition()
+{
+    QWORD pos = BASS_ChannelGetPosition(stream, BASS_POS_BYTE);
+    if (pos == (QWORD)-1)
+        return 0;
+
+    return pos / streamFrameSize;
+}
+
+void MidiSynthesizer::flushEvents()
+{
+    if (pendingEvents.empty())
+        return;
+
+    streamCalls++;
+    if (!queueTimed) {
+        BASS_MIDI_StreamEvents(stream, BASS_MIDI_EVENTS_STRUCT, pendingEvents.data(), pendingEvents.size());
+        pendingEvents.clear();
+        return;
+    }
+
+    // Positions were absolute, BASS wants the delay from the current
+    // render position for the first event and from the previous one after.
+    QWORD at = decodePosition();
+    for (BASS_MIDI_EVENT &e : pendingEvents) {
+        QWORD pos = e.pos;
+        e.pos = pos > at ? pos - at : 0;
+        at = qMax(at, pos);
+    }
+
+    BASS_MIDI_StreamEvents(stream, BASS_MIDI_EVENTS_STRUCT|BASS_MIDI_EVENTS_TIME,
+                           pendingEvents.data(), pendingEvents.size());
+    pendingEvents.clear();
+}
+
+void MidiSynthesizer::cancelEvents()
+{
+    pendingEvents.clear();
+    streamCalls++;
+    BASS_MIDI_StreamEvents(stream, BASS_MIDI_EVENTS_CANCEL, NULL, 0);
+}
+
+void MidiSynthesizer::streamEvent(int ch, DWORD event, DWORD param)
+{
+    if (queueing && std::this_thread::get_id() == queueThread) {
+        BASS_MIDI_EVENT e;
+        e.event = event;
+        e.param = param;
+        e.chan = ch;
+        e.tick = 0;
+        e.pos = eventPos;
+        pendingEvents.push_back(e);
+    } else {
+        streamCalls++;
+        BASS_MIDI_StreamEvent(stream, ch, event, param);
+    }
+}
+
 int MidiSynthesizer::mixLevel(InstrumentType t)
 {
     return instMap[t].mixlevel;
@@ -542,39 +776,376 @@ bool MidiSynthesizer::isSoundFontFile(std::string sfile)
 
 void MidiSynthesizer::setSfToStream()
 {
+    std::lock_guard<std::mutex> fontLock(fontMutex);
+
+    // Loaders of an earlier call still running drop what they load
+    fontGeneration++;
+    releaseFontsLocked();
+
+    size_t n = sfFiles.size();
+    synth_HSOUNDFONT.assign(n, 0);
+    fontReady.assign(n, false);
+    fontVolumes.assign(n, 1.0f);
+
+    // Reset map intrument sf
+    intmSf.clear();
+    for (int i=0; i<129; i++) {
+        intmSf.push_back(0);
+    }
+    {
+        std::lock_guard<std::mutex> lock(presetMutex);
+        remapTo = intmSf;
+    }
+
+    fontsLoading = n;
+    fontProgress = n > 0 ? 0 : 100;
+    fontLoaders += n;
+    for (size_t i=0; i<n; i++)
+        std::thread(&MidiSynthesizer::loadFont, this, i, sfFiles[i], fontGeneration).detach();
+}
+
+void MidiSynthesizer::releaseFontsLocked()
+{
+    {
+        std::lock_guard<std::mutex> lock(presetMutex);
+        presetQueue.clear();
+        remapPending = false;
+        loadedPresets.clear();
+    }
+    residentBytes = 0;
+
     for (HSOUNDFONT f : synth_HSOUNDFONT) {
-        BASS_MIDI_FontUnload(f,-1,0);
-        BASS_MIDI_FontFree(f);
+        if (!f)
+            continue;
+        // The pool keeps the font open, song presets loaded into it would
+        // stay there uncounted against the budget
+        if (songPresetsOnly)
+            BASS_MIDI_FontUnload(f, -1, -1);
+        MidiSoundfontPool::release(f);
     }
-    synth_HSOUNDFONT.clear();
+}
 
-    for (const std::string &sfile : sfFiles) {
-        HSOUNDFONT f = BASS_MIDI_FontInit(sfile.data(), BASS_MIDI_FONT_MMAP);
-        if (f) {
-            synth_HSOUNDFONT.push_back(f);
-            BASS_MIDI_FontLoad(f,-1,0);
+void MidiSynthesizer::loadFont(size_t index, std::string sfile, int generation)
+{
+    // The loader holds its own reference while it loads, the slot another
+    // one, so a close() meanwhile can not free the font under it
+    HSOUNDFONT f = MidiSoundfontPool::acquire(sfile);
+    if (f) {
+        std::lock_guard<std::mutex> fontLock(fontMutex);
+        if (generation == fontGeneration) {
+            synth_HSOUNDFONT[index] = MidiSoundfontPool::acquire(sfile);
+            if (synth_HSOUNDFONT[index])
+                BASS_MIDI_FontSetVolume(synth_HSOUNDFONT[index], fontVolumes[index]);
         }
     }
 
-    if (synth_HSOUNDFONT.size() > 0) {
-        BASS_MIDI_FONT font;
-        font.font = synth_HSOUNDFONT.at(0);
-        font.preset = -1;
-        font.bank = 0;
+    // The slow part, done without the lock so playback goes on
+    if (f && !songPresetsOnly)
+        BASS_MIDI_FontLoad(f,-1,0);
+
+    std::lock_guard<std::mutex> fontLock(fontMutex);
+    if (generation == fontGeneration) {
+        if (synth_HSOUNDFONT[index]) {
+            fontReady[index] = true;
+            setStreamFontsLocked();
+
+            if (songPresetsOnly) {
+                // Presets of the song that could not load without this font
+                std::set<std::pair<int, int>> missing;
+                {
+                    std::lock_guard<std::mutex> lock(presetMutex);
+                    for (const std::pair<int, int> &p : pinnedPresets) {
+                        if (loadedPresets.count(p) == 0)
+                            missing.insert(p);
+                    }
+                }
+                for (const std::pair<int, int> &p : missing)
+                    loadPresetLocked(p.first, p.second);
+            }
+        }
+    }
+
+    if (f)
+        MidiSoundfontPool::release(f);
+
+    // The last one frees fonts dropped from the list, the listed ones are
+    // all held by their slots then
+    if (generation == fontGeneration && --fontsLoading == 0)
+        MidiSoundfontPool::trim();
+
+    fontLoaders--;
+    fontLoadersDone.notify_all();
+}
+
+int MidiSynthesizer::soundfontLoadProgress()
+{
+    // Not worth blocking the caller over, a preset may be loading
+    std::unique_lock<std::mutex> fontLock(fontMutex, std::try_to_lock);
+    if (!fontLock.owns_lock() || synth_HSOUNDFONT.empty())
+        return synth_HSOUNDFONT.empty() ? 100 : fontProgress;
+
+    double done = 0;
+    for (size_t i=0; i<synth_HSOUNDFONT.size(); i++) {
+        BASS_MIDI_FONTINFO info;
+        if (fontReady[i])
+            done += 1;
+        else if (synth_HSOUNDFONT[i] && BASS_MIDI_FontGetInfo(synth_HSOUNDFONT[i], &info)
+                 && info.samsize > 0)
+            done += (double)info.samload / info.samsize;
+    }
+    fontProgress = qRound(100 * done / synth_HSOUNDFONT.size());
+
+    return fontProgress;
+}
+
+void MidiSynthesizer::setStreamFontsLocked()
+{
+    // The first font plays what is not mapped, or mapped to a font still
+    // loading. Until it is ready only the mapped presets of ready fonts
+    // play, another default would change the sound once it is.
+    if (fontReady.empty() || !openned)
+        return;
+
+    std::vector<BASS_MIDI_FONTEX> mFonts;
+
+    // check use another sf
+    for (int i=0; i<129 && i<intmSf.size(); i++) {
+
+        if (intmSf.at(i) <= 0)
+            continue;
 
-        BASS_MIDI_StreamSetFonts(0, &font, 1); // set sf to default stream
-        BASS_MIDI_StreamSetFonts(stream, &font, 1); // set to stream to
+        if (intmSf.at(i) >= synth_HSOUNDFONT.size() || !fontReady[intmSf.at(i)])
+            continue;
 
+        BASS_MIDI_FONTEX font;
+        font.font = synth_HSOUNDFONT.at(intmSf.at(i));
+
+        if (i < 128) {
+            font.spreset = i;
+            font.sbank = 0;
+            font.dpreset = i;
+            font.dbank = 0;
+            font.dbanklsb = 0;
+        }
+        else {
+            font.spreset = -1;
+            font.sbank = 128;
+            font.dpreset = -1;
+            font.dbank = 128;
+            font.dbanklsb = 0;
+        }
+
+        mFonts.push_back(font);
+    }
+
+    // defaut sf
+    if (fontReady[0]) {
+        BASS_MIDI_FONTEX f;
+        f.font = synth_HSOUNDFONT.at(0);
+        f.spreset = -1;
+        f.sbank = -1;
+        f.dpreset = -1;
+        f.dbank = 0;
+        f.dbanklsb = 0;
+
+        mFonts.push_back(f);
+    }
+
+    if (mFonts.empty())
+        return;
+
+    // set to stream
+    BASS_MIDI_StreamSetFonts(0, mFonts.data(), mFonts.size() | BASS_MIDI_FONT_EX);
+    BASS_MIDI_StreamSetFonts(stream, mFonts.data(), mFonts.size() | BASS_MIDI_FONT_EX);
+}
+
+void MidiSynthesizer::setSongPresetsOnly(bool on)
+{
+    if (on == songPresetsOnly)
+        return;
+
+    songPresetsOnly = on;
+
+    // Turning it off loads everything, as setSoundFonts() would
+    if (!on && openned) {
+        std::lock_guard<std::mutex> fontLock(fontMutex);
+        for (HSOUNDFONT f : synth_HSOUNDFONT) {
+            if (f)
+                BASS_MIDI_FontLoad(f,-1,0);
+        }
         BASS_MIDI_StreamLoadSamples(stream);
+
+        std::lock_guard<std::mutex> lock(presetMutex);
+        loadedPresets.clear();
+        pinnedPresets.clear();
     }
+}
 
-    // Reset map intrument sf
-    intmSf.clear();
-    for (int i=0; i<129; i++) {
-        intmSf.push_back(0);
+void MidiSynthesizer::preloadPresets(const std::set<std::pair<int, int>> &presets)
+{
+    if (!songPresetsOnly || !openned)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(presetMutex);
+        pinnedPresets = presets;
+    }
+
+    // Loaded on the preset thread, the caller loads a song
+    for (const std::pair<int, int> &p : presets)
+        requestPreset(p.first, p.second);
+}
+
+void MidiSynthesizer::setSampleBudget(quint64 bytes)
+{
+    sampleBudgetBytes = bytes;
+
+    if (songPresetsOnly && openned) {
+        std::lock_guard<std::mutex> fontLock(fontMutex);
+        evictPresetsLocked(std::make_pair(-1, -1));
     }
 }
 
+void MidiSynthesizer::requestPreset(int bank, int preset)
+{
+    std::lock_guard<std::mutex> lock(presetMutex);
+
+    std::pair<int, int> p(bank, preset);
+    auto it = loadedPresets.find(p);
+    if (it != loadedPresets.end()) {
+        it->second.lastUse = ++presetUses;
+        return;
+    }
+    if (std::find(presetQueue.begin(), presetQueue.end(), p) != presetQueue.end())
+        return;
+
+    presetQueue.push_back(p);
+    wakePresetThreadLocked();
+}
+
+void MidiSynthesizer::wakePresetThreadLocked()
+{
+    if (!presetThread.joinable()) {
+        presetThreadQuit = false;
+        presetThread = std::thread(&MidiSynthesizer::presetThreadRun, this);
+    }
+    presetCond.notify_one();
+}
+
+void MidiSynthesizer::loadPreset(int bank, int preset)
+{
+    std::lock_guard<std::mutex> fontLock(fontMutex);
+    loadPresetLocked(bank, preset);
+}
+
+void MidiSynthesizer::loadPresetLocked(int bank, int preset)
+{
+    // The soundfont the preset is mapped to, the default one otherwise.
+    // Presets missing from a bank are played from bank 0 by BASS.
+    int sf = intmSf.size() == 129 ? intmSf[bank == 128 ? 128 : preset] : 0;
+    if (sf <= 0 || sf >= (int)fontReady.size() || !fontReady[sf])
+        sf = 0;
+    // Not ready yet, loadFont() comes back for pinned presets
+    if (sf >= (int)fontReady.size() || !fontReady[sf])
+        return;
+    HSOUNDFONT font = synth_HSOUNDFONT[sf];
+
+    LoadedPreset loaded = { font, bank, 0 };
+    if (!BASS_MIDI_FontLoad(font, preset, bank) && bank != 0 && bank != 128) {
+        BASS_MIDI_FontLoad(font, preset, 0);
+        loaded.bank = 0;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(presetMutex);
+        loaded.lastUse = ++presetUses;
+        loadedPresets[std::make_pair(bank, preset)] = loaded;
+    }
+
+    evictPresetsLocked(std::make_pair(bank, preset));
+}
+
+void MidiSynthesizer::evictPresetsLocked(std::pair<int, int> keep)
+{
+    quint64 bytes = loadedSampleBytesLocked();
+
+    std::lock_guard<std::mutex> lock(presetMutex);
+
+    // keep, the preset just loaded, is about to play. Presets a channel is
+    // set to may be sounding.
+    while (sampleBudgetBytes > 0 && bytes > sampleBudgetBytes && loadedPresets.size() > 1) {
+        auto lru = loadedPresets.end();
+        for (auto it = loadedPresets.begin(); it != loadedPresets.end(); ++it) {
+            if (it->first == keep || pinnedPresets.count(it->first) > 0
+                    || std::find(channelPresets, channelPresets + 16, it->first) != channelPresets + 16)
+                continue;
+            if (lru == loadedPresets.end() || it->second.lastUse < lru->second.lastUse)
+                lru = it;
+        }
+        if (lru == loadedPresets.end())
+            break;
+
+        BASS_MIDI_FontUnload(lru->second.font, lru->first.second, lru->second.bank);
+        loadedPresets.erase(lru);
+        evictions++;
+
+        bytes = loadedSampleBytesLocked();
+    }
+
+    residentBytes = bytes;
+}
+
+quint64 MidiSynthesizer::loadedSampleBytesLocked()
+{
+    // Also counts samples BASS loaded on demand while playing
+    quint64 bytes = 0;
+    for (HSOUNDFONT f : synth_HSOUNDFONT) {
+        BASS_MIDI_FONTINFO info;
+        if (f && BASS_MIDI_FontGetInfo(f, &info))
+            bytes += info.samload;
+    }
+
+    return bytes;
+}
+
+void MidiSynthesizer::presetThreadRun()
+{
+    forever {
+        std::pair<int, int> p;
+        std::vector<int> map;
+        {
+            std::unique_lock<std::mutex> lock(presetMutex);
+            presetCond.wait(lock, [this] {
+                return presetThreadQuit || !presetQueue.empty() || remapPending;
+            });
+            if (presetThreadQuit)
+                return;
+            if (!presetQueue.empty()) {
+                p = presetQueue.front();
+                presetQueue.pop_front();
+            } else {
+                map = remapTo;
+                remapPending = false;
+            }
+        }
+        if (map.empty())
+            loadPreset(p.first, p.second);
+        else
+            applyMapSoundfontIndex(map);
+    }
+}
+
+void MidiSynthesizer::stopPresetThread()
+{
+    {
+        std::lock_guard<std::mutex> lock(presetMutex);
+        presetThreadQuit = true;
+        presetCond.notify_one();
+    }
+    if (presetThread.joinable())
+        presetThread.join();
+}
+
 void MidiSynthesizer::calculateEnable()
 {
     for (const auto & im : instMap) {
@@ -596,6 +1167,64 @@ void MidiSynthesizer::calculateEnable()
     }
 }
 
+// MIDI_EVENT_* of a controller, 0 when BASS has none for it
+DWORD MidiSynthesizer::controllerEvent(int number)
+{
+    switch (number) {
+    case 0:
+        return MIDI_EVENT_BANK;
+    case 1:
+        return MIDI_EVENT_MODULATION;
+    case 5:
+        return MIDI_EVENT_PORTATIME;
+    case 7:
+        return MIDI_EVENT_VOLUME;
+    case 10:
+        return MIDI_EVENT_PAN;
+    case 11:
+        return MIDI_EVENT_EXPRESSION;
+    case 32:
+        return MIDI_EVENT_BANK_LSB;
+    case 64:
+        return MIDI_EVENT_SUSTAIN;
+    case 65:
+        return MIDI_EVENT_PORTAMENTO;
+    case 66:
+        return MIDI_EVENT_SOSTENUTO;
+    case 67:
+        return MIDI_EVENT_SOFT;
+    case 71:
+        return MIDI_EVENT_RESONANCE;
+    case 72:
+        return MIDI_EVENT_RELEASE;
+    case 73:
+        return MIDI_EVENT_ATTACK;
+    case 74:
+        return MIDI_EVENT_CUTOFF;
+    case 75:
+        return MIDI_EVENT_DECAY;
+    case 84:
+        return MIDI_EVENT_PORTANOTE;
+    case 91:
+        return MIDI_EVENT_REVERB;
+    case 93:
+        return MIDI_EVENT_CHORUS;
+    case 94:
+        return MIDI_EVENT_USERFX;
+    case 120:
+        return MIDI_EVENT_SOUNDOFF;
+    case 121:
+        return MIDI_EVENT_RESET;
+    case 123:
+        return MIDI_EVENT_NOTESOFF;
+    case 126:
+    case 127:
+        return MIDI_EVENT_MODE;
+    default:
+        return 0;
+    }
+}
+
 int MidiSynthesizer::getDrumChannelFromNote(int drumNote)
 {
     int ch = 0;
@@ -18,11 +18,18 @@
 #include "BASSFX/ChorusFX.h"
 
 #include "Midi/MidiHelper.h"
+#include "Midi/MidiFile.h"
 
 #include <QSettings>
 #include <vector>
 #include <string>
 #include <map>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <set>
 
 struct Instrument
 {
@@ -33,6 +40,15 @@ struct Instrument
     int mixlevel;
 };
 
+// A song resolved to the BASS events it sends, see MidiSynthesizer::compile().
+// Song event i sends events[first[i]] up to events[first[i + 1]].
+struct MidiSynthProgram {
+    std::vector<BASS_MIDI_EVENT> events;
+    std::vector<uint32_t> first;
+
+    void clear() { events.clear(); first.clear(); }
+};
+
 
 class MidiSynthesizer
 {
@@ -47,8 +63,14 @@ public:
     void close();
 
     int outPutDevice();
+    // Moves the stream to the device while playing
     bool setOutputDevice(int dv);
+    // Soundfonts load in the background, one thread per file. Each one
+    // joins the stream when ready, the first ready one is the default.
     void setSoundFonts(std::vector<std::string> &soundfonsFiles);
+    bool isLoadingSoundfonts() { return fontsLoading > 0; }
+    // 0 - 100, by sample data loaded
+    int soundfontLoadProgress();
     void setVolume(float vol);
     float volume() { return synth_volume; }
 
@@ -58,8 +80,14 @@ public:
     // std::vector<int> size 129
     //      1-128 all intrument
     //      129 is drum
+    // Only the entries that change load samples, safe while playing.
+    // While open the samples load on the preset thread, which switches
+    // the map once they are in.
     bool setMapSoundfontIndex(const std::vector<int> &intrumentSfIndex);
-    std::vector<int> getMapSoundfontIndex() { return intmSf; }
+    // The map last set, it may still be loading
+    std::vector<int> getMapSoundfontIndex();
+    // Time the last remap took on the preset thread
+    qint64 remapMicroseconds() { return remapUs; }
 
 
     void sendNoteOff(int ch, int note, int velocity);
@@ -74,6 +102,32 @@ public:
     void sendResetAllControllers(int ch);
     void sendResetAllControllers();
 
+    // Resolves event types and drum routing of a song once. Program
+    // changes depend on the mix levels and locks at play time, they get an
+    // empty range and still go through sendProgramChange().
+    static void compile(MidiEventSpan events, MidiSynthProgram *program);
+    // Sends compiled events in one call. Notes on channels 0-15 are moved by
+    // transpose, drum snares are replaced by snareNote when it is not -1.
+    void sendCompiled(const BASS_MIDI_EVENT *events, int count, int transpose, int snareNote);
+
+    // Lookahead submission. While queueing, the send functions called from
+    // the queueing thread are collected at the stream sample position set
+    // by setEventPosition(). flushEvents() hands them to BASS in one timed
+    // BASS_MIDI_StreamEvents() call, so the renderer places each of them.
+    // Untimed queueing only batches, the events play when flushed.
+    void setQueueing(bool q, bool timed = true);
+    bool isQueueing() { return queueing; }
+    void setEventPosition(QWORD samplePos) { eventPos = samplePos; }
+    QWORD eventPosition() { return eventPos; }
+    QWORD decodePosition();
+    QWORD playPosition();
+    int latencySamples() { return deviceLatency * streamRate / 1000; }
+    int sampleRate() { return streamRate; }
+    void flushEvents();
+    void cancelEvents();
+    // BASS_MIDI_StreamEvent(s) calls made for events so far
+    quint64 streamEventCalls() { return streamCalls.load(std::memory_order_relaxed); }
+
 
     // Instrument Maper
     std::map<InstrumentType, Instrument> instrumentMap() { return instMap; }
@@ -96,9 +150,40 @@ public:
 
     bool getFX();
     void setFX(bool fx);
+
+    // Sample loading. By default every preset of every soundfont is loaded
+    // when the soundfonts are set. With song presets only, nothing is
+    // loaded up front: preloadPresets() queues what a song uses when it is
+    // loaded, and a program change to any other preset queues that preset.
+    // Queued presets load on a background thread.
+    void setSongPresetsOnly(bool on);
+    bool isSongPresetsOnly() { return songPresetsOnly; }
+    // Bank and preset pairs, bank 128 for drum kits. The presets stay
+    // pinned, out of reach of eviction, until the next song preloads.
+    void preloadPresets(const std::set<std::pair<int, int>> &presets);
+
+    // Sample memory budget for song presets only, 0 for none. Past it the
+    // least recently used presets are unloaded, except pinned ones and
+    // those a channel is set to.
+    void setSampleBudget(quint64 bytes);
+    quint64 sampleBudget() { return sampleBudgetBytes; }
+    // Sample bytes loaded as of the last preset load or eviction
+    quint64 residentSampleBytes() { return residentBytes; }
+    quint64 evictedPresets() { return evictions; }
+
 private:
     HSTREAM stream;
-    std::vector<HSOUNDFONT> synth_HSOUNDFONT;
+    std::vector<HSOUNDFONT> synth_HSOUNDFONT;  // 0 until initialized
+    std::vector<bool> fontReady;
+    std::vector<float> fontVolumes;
+    std::atomic<int> fontsLoading{0};
+    // Loader threads, guarded by fontMutex. A setSfToStream() or close()
+    // starts a new generation, older loaders then drop their font.
+    int fontGeneration = 0;
+    int fontLoaders = 0;
+    std::condition_variable fontLoadersDone;
+    std::atomic<qint64> remapUs{0};
+    int fontProgress = 100;
     std::vector<std::string> sfFiles;
     std::vector<int> intmSf;
     std::map<InstrumentType, Instrument> instMap;
@@ -111,14 +196,66 @@ private:
     // ---------------------------
 
     float synth_volume = 1.0f;
-    bool openned = false;
+    std::atomic<bool> openned{false};    // Set under fontMutex
     bool useSolo = false;
 
     int outDev = -1;
 
+    // Set by the queueing thread, the others check them to send directly.
+    // pendingEvents and queueTimed are only used by the queueing thread.
+    std::vector<BASS_MIDI_EVENT> pendingEvents;
+    std::atomic<std::thread::id> queueThread{std::thread::id()};
+    std::atomic<bool> queueing{false};
+    bool queueTimed = true;
+    std::atomic<quint64> streamCalls{0};
+    std::atomic<QWORD> eventPos{0};
+    int streamRate = 44100;
+    int streamFrameSize = 8;
+    int deviceLatency = 0;
+
+    // Song presets only, see setSongPresetsOnly(). presetMutex guards the
+    // queue and the loaded set, fontMutex the fonts while a preset loads.
+    struct LoadedPreset {
+        HSOUNDFONT font;
+        int bank;           // Bank loaded, 0 when the requested one is missing
+        quint64 lastUse;
+    };
+    bool songPresetsOnly = false;
+    std::map<std::pair<int, int>, LoadedPreset> loadedPresets;
+    std::set<std::pair<int, int>> pinnedPresets;
+    std::pair<int, int> channelPresets[16];     // Last program change, kept too
+    quint64 presetUses = 0;
+    quint64 sampleBudgetBytes = 0;
+    std::atomic<quint64> residentBytes{0};
+    std::atomic<quint64> evictions{0};
+    std::deque<std::pair<int, int>> presetQueue;
+    std::vector<int> remapTo;       // Last map set, applied when remapPending
+    bool remapPending = false;
+    std::thread presetThread;
+    std::mutex presetMutex;
+    std::mutex fontMutex;
+    std::condition_variable presetCond;
+    bool presetThreadQuit = false;
+
+    void streamEvent(int ch, DWORD event, DWORD param);
+    static int initDevice(int dv);
+    void releaseFontsLocked();
+    void loadFont(size_t index, std::string sfile, int generation);
+    void setStreamFontsLocked();
+    void requestPreset(int bank, int preset);
+    void wakePresetThreadLocked();
+    void applyMapSoundfontIndex(const std::vector<int> &intrumentSfIndex);
+    void loadPreset(int bank, int preset);
+    void loadPresetLocked(int bank, int preset);
+    void evictPresetsLocked(std::pair<int, int> keep);
+    quint64 loadedSampleBytesLocked();
+    void presetThreadRun();
+    void stopPresetThread();
+    static DWORD controllerEvent(int number);
+    static int getDrumChannelFromNote(int drumNote);
+
     void setSfToStream();
     void calculateEnable();
-    int getDrumChannelFromNote(int drumNote);
     std::vector<int> getChannelsFromType(InstrumentType t);
 
     QSettings *settings;
@@ -0,0 +1,49 @@
+#ifndef MIDITEMPOCLOCK_H
+#define MIDITEMPOCLOCK_H
+
+#include <cmath>
+#include <cstdint>
+
+/*
+    Maps song time to clock time under a playback speed.
+
+        Both are microseconds from the start of playback. A speed change
+        rebases at the current clock time, so the mapping stays continuous
+        and nothing already scheduled before it moves.
+*/
+
+class MidiTempoClock
+{
+public:
+    MidiTempoClock() { reset(1.0); }
+
+    void reset(double speed) {
+        songAnchor = 0;
+        clockAnchor = 0;
+        fSpeed = speed;
+    }
+
+    void rebase(int64_t clockUs, double speed) {
+        songAnchor = songTime(clockUs);
+        clockAnchor = clockUs;
+        fSpeed = speed;
+    }
+
+    double  speed() const { return fSpeed; }
+
+    // Rounded, a cast would lose a whole microsecond to 1.1 being inexact
+    int64_t songTime(int64_t clockUs) const {
+        return songAnchor + std::llround((clockUs - clockAnchor) * fSpeed);
+    }
+
+    int64_t clockTime(int64_t songUs) const {
+        return clockAnchor + std::llround((songUs - songAnchor) / fSpeed);
+    }
+
+private:
+    int64_t songAnchor;
+    int64_t clockAnchor;
+    double  fSpeed;
+};
+
+#endif // MIDITEMPOCLOCK_H
@@ -678,6 +678,7 @@ void SettingsDialog::on_btnSfFinish_clicked()
 
     MidiSynthesizer *synth = mainWin->midiPlayer()->midiSynthesizer();
     synth->setSoundFonts(sfs);
+    mainWin->showSoundfontLoading();
 
     ui->btnSfAdd->setEnabled(false);
     ui->btnSfRemove->setEnabled(false);
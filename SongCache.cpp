@@ -0,0 +1,139 @@
+#include "SongCache.h"
+
+#include "Midi/MidiPlayer.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QCryptographicHash>
+
+#include <cstring>
+
+static const char     HKC_MAGIC[4] = { 'H', 'K', 'C', 0 };
+static const uint32_t HKC_VERSION  = 1;
+
+struct HkcHeader {
+    char     magic[4];
+    uint32_t version;
+    uint64_t checksum;      // Of everything after the header
+    int64_t  midSize;
+    int64_t  midModified;
+    int64_t  curSize;       // -1 when the song has no .cur
+    int64_t  curModified;
+    uint64_t playerSize;    // MidiPlayer::saveCache() bytes, then the cursors
+    uint64_t cursorCount;
+};
+
+// FNV-1a over 64 bit words, good enough to catch a torn or stale write
+static uint64_t checksum(const unsigned char *data, size_t size)
+{
+    uint64_t h = 14695981039346656037ULL;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        h = (h ^ w) * 1099511628211ULL;
+    }
+    for (; i < size; i++)
+        h = (h ^ data[i]) * 1099511628211ULL;
+
+    return h;
+}
+
+static void sourceStamp(const QString &path, int64_t *size, int64_t *modified)
+{
+    QFileInfo fi(path);
+    if (fi.exists() && fi.isFile()) {
+        *size = fi.size();
+        *modified = fi.lastModified().toMSecsSinceEpoch();
+    } else {
+        *size = -1;
+        *modified = 0;
+    }
+}
+
+QString SongCache::cacheFilePath(const QString &midPath)
+{
+    QString key = QFileInfo(midPath).absoluteFilePath();
+    QByteArray hash = QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Md5).toHex();
+
+    return QDir::toNativeSeparators(QDir::currentPath() + "/Data/Cache/" + QString::fromLatin1(hash) + ".hkc");
+}
+
+bool SongCache::load(const QString &midPath, const QString &curPath, MidiPlayer *player, QList<long> *cursors)
+{
+    QFile file(cacheFilePath(midPath));
+    if (file.size() < (qint64)sizeof(HkcHeader) || !file.open(QIODevice::ReadOnly))
+        return false;
+
+    const unsigned char *data = file.map(0, file.size());
+    if (data == nullptr)
+        return false;
+
+    size_t size = file.size();
+    HkcHeader h;
+    memcpy(&h, data, sizeof(h));
+
+    int64_t midSize, midModified, curSize, curModified;
+    sourceStamp(midPath, &midSize, &midModified);
+    sourceStamp(curPath, &curSize, &curModified);
+
+    const unsigned char *body = data + sizeof(h);
+    size_t bodySize = size - sizeof(h);
+
+    if (memcmp(h.magic, HKC_MAGIC, 4) != 0 || h.version != HKC_VERSION
+            || h.midSize != midSize || h.midModified != midModified
+            || h.curSize != curSize || h.curModified != curModified
+            || h.playerSize > bodySize || h.cursorCount > (bodySize - h.playerSize) / sizeof(int64_t)
+            || h.playerSize + h.cursorCount * sizeof(int64_t) != bodySize
+            || checksum(body, bodySize) != h.checksum)
+        return false;
+
+    if (!player->loadCache(body, h.playerSize))
+        return false;
+
+    cursors->clear();
+    cursors->reserve(h.cursorCount);
+    const unsigned char *c = body + h.playerSize;
+    for (uint64_t i=0; i<h.cursorCount; i++) {
+        int64_t tick;
+        memcpy(&tick, c + i * sizeof(tick), sizeof(tick));
+        cursors->append(tick);
+    }
+
+    return true;
+}
+
+bool SongCache::save(const QString &midPath, const QString &curPath, MidiPlayer *player, const QList<long> &cursors)
+{
+    std::vector<unsigned char> body;
+    player->saveCache(&body);
+    uint64_t playerSize = body.size();
+
+    for (long cur : cursors) {
+        int64_t tick = cur;
+        const unsigned char *b = reinterpret_cast<const unsigned char*>(&tick);
+        body.insert(body.end(), b, b + sizeof(tick));
+    }
+
+    HkcHeader h;
+    memcpy(h.magic, HKC_MAGIC, 4);
+    h.version = HKC_VERSION;
+    h.checksum = checksum(body.data(), body.size());
+    sourceStamp(midPath, &h.midSize, &h.midModified);
+    sourceStamp(curPath, &h.curSize, &h.curModified);
+    h.playerSize = playerSize;
+    h.cursorCount = cursors.size();
+
+    QDir().mkpath(QDir::currentPath() + "/Data/Cache");
+
+    QSaveFile file(cacheFilePath(midPath));
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+
+    file.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    file.write(reinterpret_cast<const char*>(body.data()), body.size());
+
+    return file.commit();
+}
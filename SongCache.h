@@ -0,0 +1,27 @@
+#ifndef SONGCACHE_H
+#define SONGCACHE_H
+
+#include <QString>
+#include <QList>
+
+class MidiPlayer;
+
+/*
+    Parsed songs kept under Data/Cache as .hkc files.
+
+        One file holds the player image of a song (events, tempo map,
+        event times, beat map) and its lyric cursor ticks. A cache is only
+        used while the .mid and .cur it was built from keep the same size
+        and modification time, and its checksum matches.
+*/
+
+class SongCache
+{
+public:
+    static QString cacheFilePath(const QString &midPath);
+
+    static bool load(const QString &midPath, const QString &curPath, MidiPlayer *player, QList<long> *cursors);
+    static bool save(const QString &midPath, const QString &curPath, MidiPlayer *player, const QList<long> &cursors);
+};
+
+#endif // SONGCACHE_H
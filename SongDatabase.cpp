@@ -205,15 +205,13 @@ bool SongDatabase::insertNCN(const QString &ncnPath, const QString &songId, cons
         if (mit.hasNext()) {
             mit.next();
 
-            MidiFile *midi = new MidiFile();
-            if (!midi->read(mit.filePath().toStdString(), true)) {
-                delete midi;
+            MidiFileInfo info;
+            if (!MidiFile::readInfo(mit.filePath().toStdString(), &info, true)) {
                 return false;
             }
             emit updateSongNameChanged(mit.fileName());
             path = mit.filePath().replace(ncnPath, "");
-            bpm = midi->bpm();
-            delete midi;
+            bpm = info.bpm();
         } else {
             return false;
         }
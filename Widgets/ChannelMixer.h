@@ -32,11 +32,11 @@ public:
 
     void setPlayer(MidiPlayer *p);
     void peak(int ch, int value);
+    void onPlayerPlayingEvent(const MidiEventRecord &e);
 
 public slots:
     void showDeTail(int ch);
     void onPlayerLoaded();
-    void onPlayerPlayingEvent(MidiEvent *e);
 
 signals:
     void buttonCloseClicked();
@@ -0,0 +1,255 @@
+#include "MidiFile.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// MidiFile::read() merges the tracks, same tick events going to the lower
+// track, the order a stable sort by tick of the tracks one after another
+// gives. These build files with many same tick events and check it.
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+struct Expected {
+    uint32_t tick;
+    int track;
+    MidiEventType type;
+    int metaType;       // Meta events only
+    int channel;
+    int data1;
+    int data2;
+};
+
+static void writeVariableLength(std::vector<unsigned char> *out, uint32_t v)
+{
+    unsigned char bytes[5];
+    int n = 0;
+    bytes[n++] = v & 0x7F;
+    while (v >>= 7)
+        bytes[n++] = 0x80 | (v & 0x7F);
+    while (n > 0)
+        out->push_back(bytes[--n]);
+}
+
+static void writeBigEndian(std::vector<unsigned char> *out, uint32_t v, int size)
+{
+    for (int i = size - 1; i >= 0; i--)
+        out->push_back((v >> (8 * i)) & 0xFF);
+}
+
+// Format 1 file of trackCount tracks, events as the song expects them
+// after read(), in file order
+static std::vector<unsigned char> buildSong(int trackCount, int eventsPerTrack, uint32_t seed,
+                                            std::vector<Expected> *expected)
+{
+    std::vector<unsigned char> file = { 'M', 'T', 'h', 'd' };
+    writeBigEndian(&file, 6, 4);
+    writeBigEndian(&file, 1, 2);
+    writeBigEndian(&file, trackCount, 2);
+    writeBigEndian(&file, 96, 2);
+
+    // Mostly 0 deltas, so tracks collide on the same ticks
+    static const uint32_t deltas[] = { 0, 0, 0, 1, 2, 5 };
+
+    for (int t = 0; t < trackCount; t++) {
+        std::vector<unsigned char> trk;
+        uint32_t tick = 0;
+        int ch = t % 16;
+
+        for (int i = 0; i < eventsPerTrack; i++) {
+            seed = seed * 1103515245 + 12345;
+            uint32_t delta = deltas[(seed >> 16) % 6];
+            tick += delta;
+            writeVariableLength(&trk, delta);
+
+            Expected e = { tick, t, MidiEventType::None, 0, ch, 0, 0 };
+            int d1 = (seed >> 8) & 0x7F;
+            int d2 = ((seed >> 24) & 0x7F) | 1;
+
+            switch ((seed >> 20) % 5) {
+            case 0:
+                e.type = MidiEventType::ProgramChange;
+                e.data1 = d1;
+                trk.push_back(0xC0 | ch);
+                trk.push_back(d1);
+                break;
+            case 1:
+                e.type = MidiEventType::Controller;
+                e.data1 = d1;
+                e.data2 = d2;
+                trk.push_back(0xB0 | ch);
+                trk.push_back(d1);
+                trk.push_back(d2);
+                break;
+            case 2:
+                e.type = MidiEventType::NoteOn;
+                e.data1 = d1;
+                e.data2 = d2;
+                trk.push_back(0x90 | ch);
+                trk.push_back(d1);
+                trk.push_back(d2);
+                break;
+            case 3:
+                e.type = MidiEventType::NoteOff;
+                e.data1 = d1;
+                trk.push_back(0x80 | ch);
+                trk.push_back(d1);
+                trk.push_back(0);
+                break;
+            default: {
+                uint32_t tempo = 400000 + ((seed >> 4) & 0xFFFF);
+                e.type = MidiEventType::Meta;
+                e.metaType = (int)MidiMetaType::SetTempo;
+                trk.push_back(0xFF);
+                trk.push_back(0x51);
+                trk.push_back(3);
+                writeBigEndian(&trk, tempo, 3);
+                break;
+            }
+            }
+            expected->push_back(e);
+        }
+
+        trk.push_back(0);
+        trk.push_back(0xFF);
+        trk.push_back(0x2F);
+        trk.push_back(0);
+        Expected end = { tick, t, MidiEventType::Meta, (int)MidiMetaType::EndOfTrack, 0, 0, 0 };
+        expected->push_back(end);
+
+        file.push_back('M');
+        file.push_back('T');
+        file.push_back('r');
+        file.push_back('k');
+        writeBigEndian(&file, trk.size(), 4);
+        file.insert(file.end(), trk.begin(), trk.end());
+    }
+
+    return file;
+}
+
+static bool sameEvent(const MidiEvent *e, const Expected &x)
+{
+    if (e->tick() != x.tick || e->track() != x.track || e->eventType() != x.type)
+        return false;
+    if (x.type == MidiEventType::Meta)
+        return (int)e->metaEventType() == x.metaType;
+    return e->channel() == x.channel && e->data1() == x.data1 && e->data2() == x.data2;
+}
+
+static bool checkList(MidiEventSpan events, const std::vector<Expected> &expected)
+{
+    if (events.size() != expected.size())
+        return false;
+    for (size_t i = 0; i < expected.size(); i++) {
+        if (!sameEvent(events[i], expected[i]))
+            return false;
+    }
+    return true;
+}
+
+static std::vector<Expected> filter(const std::vector<Expected> &all, MidiEventType type, int metaType = 0)
+{
+    std::vector<Expected> out;
+    for (const Expected &x : all) {
+        if (x.type == type && (type != MidiEventType::Meta || x.metaType == metaType))
+            out.push_back(x);
+    }
+    return out;
+}
+
+static void testMergeOrder(int trackCount, int eventsPerTrack, uint32_t seed, int readThreads)
+{
+    std::vector<Expected> expected;
+    std::vector<unsigned char> bytes = buildSong(trackCount, eventsPerTrack, seed, &expected);
+
+    const std::string path = "MidiFileTest.mid";
+    {
+        std::ofstream out(path.c_str(), std::ios::binary);
+        out.write((const char*)bytes.data(), bytes.size());
+    }
+
+    // What the old std::sort of the whole song meant to give
+    std::stable_sort(expected.begin(), expected.end(), [](const Expected &a, const Expected &b) {
+        return a.tick < b.tick;
+    });
+
+    MidiFile midi;
+    midi.setReadThreads(readThreads);
+    CHECK(midi.read(path));
+    std::remove(path.c_str());
+
+    MidiEventSpan events = midi.events();
+    CHECK(checkList(events, expected));
+
+    // Same tick ties go to the lower track
+    for (size_t i = 1; i < events.size(); i++) {
+        if (events[i]->tick() == events[i - 1]->tick())
+            CHECK(events[i]->track() >= events[i - 1]->track());
+        else
+            CHECK(events[i]->tick() > events[i - 1]->tick());
+    }
+
+    // The typed lists are filled in the same order
+    CHECK(checkList(midi.programChangeEvents(), filter(expected, MidiEventType::ProgramChange)));
+    CHECK(checkList(midi.controllerEvents(), filter(expected, MidiEventType::Controller)));
+    CHECK(checkList(midi.tempoEvents(), filter(expected, MidiEventType::Meta, (int)MidiMetaType::SetTempo)));
+}
+
+static void testSameTickAcrossTracks()
+{
+    // Program change on track 1 and note on track 0 at the same tick, the
+    // note comes first although track 1's event was written first
+    std::vector<unsigned char> file = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 1, 0, 2, 0, 96 };
+    const unsigned char track0[] = { 'M', 'T', 'r', 'k', 0, 0, 0, 8,
+                                     10, 0x90, 60, 100,
+                                     0, 0xFF, 0x2F, 0 };
+    const unsigned char track1[] = { 'M', 'T', 'r', 'k', 0, 0, 0, 7,
+                                     10, 0xC1, 5,
+                                     0, 0xFF, 0x2F, 0 };
+    file.insert(file.end(), track0, track0 + sizeof(track0));
+    file.insert(file.end(), track1, track1 + sizeof(track1));
+
+    const std::string path = "MidiFileTest.mid";
+    {
+        std::ofstream out(path.c_str(), std::ios::binary);
+        out.write((const char*)file.data(), file.size());
+    }
+
+    MidiFile midi;
+    CHECK(midi.read(path));
+    std::remove(path.c_str());
+
+    MidiEventSpan events = midi.events();
+    CHECK(events.size() == 4);
+    if (events.size() == 4) {
+        CHECK(events[0]->eventType() == MidiEventType::NoteOn && events[0]->track() == 0);
+        CHECK(events[1]->eventType() == MidiEventType::Meta && events[1]->track() == 0);
+        CHECK(events[2]->eventType() == MidiEventType::ProgramChange && events[2]->track() == 1);
+        CHECK(events[3]->eventType() == MidiEventType::Meta && events[3]->track() == 1);
+    }
+}
+
+int main()
+{
+    testSameTickAcrossTracks();
+    testMergeOrder(1, 200, 1, 1);
+    testMergeOrder(2, 500, 2, 1);
+    testMergeOrder(16, 1000, 3, 1);
+    testMergeOrder(16, 1000, 3, 4);
+    testMergeOrder(40, 300, 4, 2);
+
+    if (failures == 0)
+        std::printf("MidiFileTest: all passed\n");
+    return failures == 0 ? 0 : 1;
+}
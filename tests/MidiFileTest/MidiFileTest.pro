@@ -0,0 +1,13 @@
+QT       -= core gui
+CONFIG   += console c++11 thread
+CONFIG   -= qt app_bundle
+
+TARGET = MidiFileTest
+TEMPLATE = app
+
+INCLUDEPATH += ../../Midi
+
+SOURCES += MidiFileTest.cpp \
+    ../../Midi/MidiFile.cpp \
+    ../../Midi/MidiEvent.cpp \
+    ../../Midi/MidiEventPool.cpp
@@ -0,0 +1,138 @@
+#include "MidiFile.h"
+#include "MidiTempoClock.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// MidiPlayer waits for clockTime() of each event's song time. Checks the
+// deadlines across the speed range, and that a speed change while playing
+// does not move the position.
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static const double speeds[] = { 0.5, 0.6, 0.75, 0.9, 1.0, 1.1, 1.25, 1.5, 1.75, 2.0 };
+static const int speedCount = sizeof(speeds) / sizeof(speeds[0]);
+
+static void writeBigEndian(std::vector<unsigned char> *out, uint32_t v, int size)
+{
+    for (int i = size - 1; i >= 0; i--)
+        out->push_back((v >> (8 * i)) & 0xFF);
+}
+
+// One track of tempo changes every 960 ticks, about 20 minutes long
+static bool readTempoSong(MidiFile *midi)
+{
+    std::vector<unsigned char> trk;
+    for (int i = 0; i < 600; i++) {
+        uint32_t tempo = 300000 + (i * 7919) % 900000;
+        if (i > 0) {
+            trk.push_back(0x87);    // Delta 960
+            trk.push_back(0x40);
+        } else {
+            trk.push_back(0);
+        }
+        trk.push_back(0xFF);
+        trk.push_back(0x51);
+        trk.push_back(3);
+        writeBigEndian(&trk, tempo, 3);
+    }
+    trk.push_back(0x87);
+    trk.push_back(0x40);
+    trk.push_back(0xFF);
+    trk.push_back(0x2F);
+    trk.push_back(0);
+
+    std::vector<unsigned char> file = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0x01, 0xE0,
+                                        'M', 'T', 'r', 'k' };
+    writeBigEndian(&file, trk.size(), 4);
+    file.insert(file.end(), trk.begin(), trk.end());
+
+    const std::string path = "MidiTempoClockTest.mid";
+    {
+        std::ofstream out(path.c_str(), std::ios::binary);
+        out.write((const char*)file.data(), file.size());
+    }
+    bool ok = midi->read(path);
+    std::remove(path.c_str());
+
+    return ok;
+}
+
+static void testDeadlines(MidiFile *midi)
+{
+    uint32_t lastTick = 600 * 960;
+
+    for (int s = 0; s < speedCount; s++) {
+        MidiTempoClock clock;
+        clock.reset(speeds[s]);
+
+        for (uint32_t tick = 0; tick <= lastTick; tick += 37) {
+            int64_t songUs = midi->microsecondsFromTick(tick);
+            double want = songUs / speeds[s];
+            double diff = clock.clockTime(songUs) - want;
+            CHECK(diff >= -1.0 && diff <= 1.0);
+        }
+    }
+}
+
+static void testRebase(MidiFile *midi)
+{
+    int64_t duration = midi->microsecondsFromTick(600 * 960);
+
+    // Speed changes at odd moments while playing, as the UI makes them
+    MidiTempoClock clock;
+    clock.reset(1.0);
+    int64_t clockUs = 0;
+    int64_t lastSong = 0;
+    uint32_t seed = 7;
+
+    while (clock.songTime(clockUs) < duration) {
+        seed = seed * 1103515245 + 12345;
+        clockUs += 1 + (seed >> 8) % 3000000;
+        double speed = speeds[(seed >> 20) % speedCount];
+
+        int64_t before = clock.songTime(clockUs);
+        clock.rebase(clockUs, speed);
+        int64_t after = clock.songTime(clockUs);
+
+        // No jump at the rebase, and never backwards
+        CHECK(after == before);
+        CHECK(after >= lastSong);
+        lastSong = after;
+
+        // Events after it are due at the new speed from there
+        for (uint32_t tick = midi->tickFromMicroseconds(after) + 1; ; tick += 53) {
+            int64_t songUs = midi->microsecondsFromTick(tick);
+            if (songUs > after + 3000000)
+                break;
+            double want = clockUs + (songUs - after) / speed;
+            double diff = clock.clockTime(songUs) - want;
+            CHECK(diff >= -1.0 && diff <= 1.0);
+            CHECK(clock.clockTime(songUs) >= clockUs);
+        }
+    }
+}
+
+int main()
+{
+    MidiFile midi;
+    CHECK(readTempoSong(&midi));
+
+    testDeadlines(&midi);
+    testRebase(&midi);
+
+    if (failures == 0)
+        std::printf("MidiTempoClockTest: all passed\n");
+    return failures == 0 ? 0 : 1;
+}
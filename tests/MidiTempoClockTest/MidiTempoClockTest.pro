@@ -0,0 +1,15 @@
+QT       -= core gui
+CONFIG   += console c++11 thread
+CONFIG   -= qt app_bundle
+
+TARGET = MidiTempoClockTest
+TEMPLATE = app
+
+INCLUDEPATH += ../../Midi
+
+SOURCES += MidiTempoClockTest.cpp \
+    ../../Midi/MidiFile.cpp \
+    ../../Midi/MidiEvent.cpp \
+    ../../Midi/MidiEventPool.cpp
+
+HEADERS += ../../Midi/MidiTempoClock.h
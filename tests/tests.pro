@@ -0,0 +1,7 @@
+# Standalone tests of the Qt-free Midi/ classes, run each binary, it
+# returns non zero on failure
+
+TEMPLATE = subdirs
+
+SUBDIRS += MidiFileTest \
+    MidiTempoClockTest